@@ -3,6 +3,7 @@
 #include <assert.h>
 #include "ext/stb_image.h"
 #include <stdlib.h>
+#include <string.h>
 #include <SDL3/SDL.h>
 
 #define RESX 620
@@ -12,6 +13,15 @@
 #define SCREEN_HEIGHT 800
 #define FRAME_RATE 1000
 #define DESIRED_FRAME_TIME (1.0 / FRAME_RATE)
+#define TARGET_FRAME_TIME (1.0 / 60.0) // frame time the resolution governor tries to stay under
+#define IDLE_WAIT_MS 16 // how long to sleep waiting for input when the last frame didn't change
+
+// Dynamic resolution: RESX x RESY is the full internal resolution, the governor scales it
+// down in steps when frames take too long and back up when there is room again
+#define MIN_RENDER_SCALE 0.4f
+#define RENDER_SCALE_STEP 0.1f
+#define GOVERNOR_DOWN_FRAMES 10 // consecutive slow frames before dropping resolution
+#define GOVERNOR_UP_FRAMES 60 // consecutive fast frames before raising it
 
 #define RAY_COUNT RESX
 #define ANIM_FRAME_TIME (1.0f / 12.0f) // 12fps
@@ -43,6 +53,13 @@
 #define DEG2RAD (SDL_PI_F / 180.0f)
 #define RAD2DEG (180.0f / SDL_PI_F)
 
+// Texels are kept as SDL_PIXELFORMAT_ABGR8888 so R is always the low byte
+#define PACK_COLOR(R, G, B, A) ((uint32_t)(R) | (uint32_t)(G) << 8 | (uint32_t)(B) << 16 | (uint32_t)(A) << 24)
+#define COLOR_R(C) ((C) & 0xFF)
+#define COLOR_G(C) (((C) >> 8) & 0xFF)
+#define COLOR_B(C) (((C) >> 16) & 0xFF)
+#define COLOR_A(C) ((C) >> 24)
+
 //---Structures---
 typedef struct {
     uint8_t r;
@@ -53,17 +70,50 @@ typedef struct {
 typedef struct {
     float x;
     float y;
+    int cell;
     int wall_id;
     int wall_orient;
 } RayData;
 
+typedef struct {
+    float x;
+    float y;
+    float dir_x; // unit view direction
+    float dir_y;
+    float plane_x; // half of the view plane at distance 1, points to the right
+    float plane_y;
+    float plane_length;
+} Camera;
+
+// Result of the wall pass for one screen column
+typedef struct {
+    float hit_x;
+    float hit_y;
+    int cell;
+    int wall_id; // 0 if nothing was hit
+    int wall_orient;
+    float texture_u;
+    float depth; // distance along the view direction
+    float bottom; // part of the wall that is visible, 0 to 1 is all of a full height wall
+    float top;
+    int layer_count; // walls in front of this one that don't hide it, in g_column_layers
+} Column;
+
 typedef struct {
     bool quit;
     bool map_mode;
+    bool software_render; // draw the scene into the cpu framebuffer instead of with SDL
+    bool wall_spans; // find walls by projecting visible faces instead of a ray per column
+    bool interlaced; // cast half the columns each frame and rebuild the rest from the last frame
+    bool reveal_map; // map mode shows the whole layout instead of what was seen
+    bool indexed_color; // software renderer draws 8 bit palette indices
+    bool redraw; // force the next frame to be drawn from scratch
+    bool frame_changed; // the last frame drew something
 
     // time in seconds
     double last_frame; 
     double delta_time;
+    double time; // game clock, animations play from it
 
     // Mouse
     float mouse_sens;
@@ -74,54 +124,120 @@ typedef struct {
 } EngineState;
 
 
+#define MAX_MIP_LEVELS 12
+
+// An image with its full mip chain. Level 0 is the source image and every level after
+// that is half the size of the one before it. The cpu copy is used by the software
+// renderer and every level is also uploaded for the SDL renderer.
+//
+// The cpu copy is stored transposed (column-major) since walls and sprites are drawn one
+// vertical strip at a time, that way a strip reads its texels sequentially. Columns are
+// padded to a power of two so texel (x, y) of a level is at (x << mip_shift) + y.
+typedef struct {
+    int width;
+    int height;
+    int mip_count;
+    int mip_width[MAX_MIP_LEVELS];
+    int mip_height[MAX_MIP_LEVELS];
+    int mip_shift[MAX_MIP_LEVELS]; // log2 of the padded column height
+    uint32_t *pixels[MAX_MIP_LEVELS]; // column-major ABGR8888
+    uint8_t *indexed[MAX_MIP_LEVELS]; // same layout quantized to g_palette, once the palette is built
+    SDL_Texture *levels[MAX_MIP_LEVELS];
+} Texture;
+
+typedef struct {
+    uint32_t *pixels;
+    uint32_t *walls; // copy of the pixels after the wall pass, to redraw sprites over
+    uint8_t *indexed; // palette indices in indexed color mode, expanded into pixels when presenting
+    uint8_t *indexed_walls;
+    int width;
+    int height;
+    SDL_Rect clip; // drawing is limited to this
+    SDL_Texture *texture; // streaming texture the pixels are uploaded to
+} Framebuffer;
+
 typedef struct {
     float x;
     float y;
-    SDL_Texture *texture;
+    Texture *texture;
     Color tint;
 } Sprite;
 
 typedef struct {
-    SDL_Texture **frames;
+    Texture **frames;
     int current_frame;
     int frame_count;
     float frame_time;
-    float timer;
 } AnimatedSprite;
 
+// Frames of an animation, shared by everything that plays it. Which frame is showing
+// comes from the game clock so instances don't keep any timers.
+typedef struct {
+    Texture **frames;
+    int frame_count;
+    float frame_time;
+} AnimationClip;
+
 typedef enum {
     OBJECT_STATIC,
     OBJECT_ANIMATED,
 } ObjectSpriteType;
 
+typedef union {
+    const AnimationClip *clip;
+    Texture *static_frame;
+} ObjectSprite;
+
+// Objects and enemies keep each field in its own array, index i in all of them is one
+// entity. Passes over every entity only load the fields they use.
 typedef struct {
-    float x;
-    float y;
-    int id; // Which object is this
-    ObjectSpriteType sprite_type;
-    union {
-        AnimatedSprite animated;
-        SDL_Texture *static_frame;
-    } sprite;
-} Object;
+    int count;
+    int capacity;
+    float *x;
+    float *y;
+    int *light; // light level it gives off, 0 for none
+    int *id; // Which object is this
+    ObjectSpriteType *sprite_type;
+    ObjectSprite *sprite;
+    float *phase; // seconds ahead of the clock its animation is
+} Objects;
 
 typedef enum {
     ENEMY_NORMAL,
     ENEMY_HURT,
 } EnemyState;
 
+// Refers to an enemy until it dies, after that its slot can be reused by a new enemy
+// with a different generation so the handle doesn't find it
 typedef struct {
-    float x;
-    float y;
-    float radius;
-    int health;
-    bool dead;
-    int damage;
+    int slot;
+    int generation;
+} EnemyHandle;
 
-    float timer;
-    EnemyState state;
-    AnimatedSprite sprite;
-} Enemy;
+// Live enemies are packed at the front of the arrays, dead ones are swapped out with
+// the last one. Slots give them a stable handle while they move around.
+typedef struct {
+    int count;
+    int capacity;
+    // updated every frame
+    float *x;
+    float *y;
+    float *radius;
+    int *health; // despawned at 0
+    EnemyState *state;
+    uint32_t *hurt_until; // tick its last hurt timer runs out
+    uint8_t *alert; // has seen the player and is chasing them
+    int *cell; // worked out each update
+    uint8_t *sees_player;
+    // only for drawing
+    const AnimationClip **clip;
+
+    int *slot; // of each enemy
+    int *slot_index; // enemy in each slot, or the next free slot
+    int *slot_generation; // bumped when the slot is freed
+    int slot_count;
+    int free_slot; // -1 when they are all used
+} Enemies;
 
 typedef enum {
     WEAPON_IDLE,
@@ -153,22 +269,106 @@ typedef struct {
     float fov;
 } Player;
 
+#define MAP_JOURNAL_SIZE 64
+#define PUSH_WALL_CELLS 2 // how far a push wall moves
+
+typedef enum {
+    DOOR_SLIDING, // slides sideways into the wall next to it
+    DOOR_PUSH_WALL, // a wall that moves away from the player when used
+} DoorKind;
+
+typedef enum {
+    DOOR_CLOSED,
+    DOOR_OPENING, // push walls are opening while they move
+    DOOR_OPEN,
+    DOOR_CLOSING,
+} DoorState;
+
+// A wall drawn as a plane across its cell. Doors are inset half a cell and slide open,
+// push walls are drawn as their front face moving through the cell.
+typedef struct {
+    DoorKind kind;
+    DoorState state;
+    int cell;
+    int orient; // WALL_HORIZONTAL if the plane runs along x
+    float offset; // where the plane crosses the cell, 0 to 1 along the other axis
+    float open; // how much of a door has slid into the wall, or how far a push wall has moved into the next cell
+    float timer; // open doors close again after this
+    int direction; // push walls move +1 or -1 along the other axis
+    int cells_left; // push walls stop after moving this many cells
+    bool active; // in g_map.active_doors
+    int moved; // g_map.door_version when it last moved
+} Door;
+
+// What a light added to the grid when it was last spread, so it can be taken back out
+typedef struct {
+    int object; // in g_map.objects
+    int level; // and where it was spread from
+    int cell;
+    int *cells; // cell and amount pairs
+    int count;
+    int capacity;
+} LightSpread;
+
+
 typedef struct {
     int *map; // wall layout array
     int width;
     int height;
+    int revision; // bumped whenever the layout changes, or a cell starts or stops blocking
+    int journal[MAP_JOURNAL_SIZE]; // cell changed by each revision, revision r is at r % MAP_JOURNAL_SIZE
+
+    // a wall fills its cell from floor_height to ceiling_height, 0 to 1 is a full height wall
+    float *floor_height;
+    float *ceiling_height;
+    float max_height; // tallest wall, nothing can be seen over a full wall this tall
+
+    // doors
+    Door *doors;
+    int door_count;
+    int *door_index; // door in each cell, -1 if there isn't one
+    int *active_doors; // doors that are moving or waiting to close, only these are updated
+    int active_count;
+    int door_version; // bumped whenever a door moves, doors moving aren't journalled
+
+    // lighting
+    int light; // ambient light, 0 to LIGHT_LEVELS - 1
+    uint8_t *light_grid; // light level of each cell
+    uint16_t *light_sum; // what the lights add to each cell
+    int *light_steps; // BFS distance + 1 for cells seen by the spread in progress, 0 otherwise
+    int *light_queue;
+    LightSpread *lights; // one for each light giving object
+    int light_count;
+    int light_revision; // map revision the lights were spread for
+    int lighting_version; // bumped whenever the light grid changes
 
     // for 2d view
     float x_scale;
     float y_scale;
-
-    Object *objects;
-    int object_count;
+    SDL_Texture *grid; // walls and grid lines, rebuilt when the layout or scale changes
+    int grid_revision;
+    int grid_door_version;
+
+    // automap
+    uint32_t *seen; // bit per cell, set by rays passing through
+    int *revealed; // cells in the order they were seen
+    int revealed_count;
+    SDL_Texture *automap; // AUTOMAP_CELL pixels per cell, unseen cells are transparent
+    int automap_count; // revealed cells already drawn into the automap
+    int automap_revision;
+    int automap_door_version;
+
+    Objects objects;
     int object_type_count;
+    Enemies enemies;
 
-    Enemy *enemies;
-    int enemy_count;
-    int enemy_type_count;
+    // enemies chase the player along this
+    int *flow_next; // next cell toward the player, -1 in their cell, -2 if they can't be reached
+    uint8_t *flow_blocked; // cells it goes around
+    int *flow_queue;
+    int flow_size;
+    int flow_cell; // player cell it leads to
+    int flow_revision; // map revision flow_blocked is up to date with
 
 } Map;
 
@@ -180,6 +380,9 @@ enum {
     TEXTURE_WALL_FLAG,
 
     TEXTURE_SKY,
+    TEXTURE_FLOOR,
+    TEXTURE_BARS, // see-through wall
+    TEXTURE_DOOR,
 };
 
 enum {
@@ -196,6 +399,7 @@ EngineState e_state = {
     .last_frame = 0.0,
     .delta_time = 0.0,
     .mouse_sens = 60.0f,
+    .frame_changed = true,
 };
 
 Map g_map = {0};
@@ -212,11 +416,148 @@ Player player = {
 };
 
 #define MAX_TEXTURES 16
-SDL_Texture *g_textures[MAX_TEXTURES];
+Texture *g_textures[MAX_TEXTURES];
+
+#define MAX_CLIPS 16
+AnimationClip g_clips[MAX_CLIPS];
+int g_clip_count = 0;
+
+// What kind of wall each wall id is
+#define WALL_TRANSPARENT 1 // rays keep going, drawn over what is behind it
+
+uint8_t g_wall_flags[MAX_TEXTURES] = {
+    [TEXTURE_BARS] = WALL_TRANSPARENT,
+};
+
+Framebuffer g_framebuffer = {0};
+
+Camera g_camera = {0};
+Column g_columns[RAY_COUNT];
+
+// What the wall pass produced last frame, for interlaced rendering
+typedef struct {
+    Camera camera;
+    Column columns[RAY_COUNT];
+    int ray_count;
+    bool valid;
+    int parity; // which half of the columns gets cast this frame
+} InterlaceState;
+
+InterlaceState g_interlace = {0};
+
+float g_z_buffer[RAY_COUNT]; // depth of each column's wall
+
+// Nearest and furthest wall over tiles of 8, 32 and 128 columns of the z-buffer,
+// built after the wall pass so sprites can be tested against a range of columns at once
+#define Z_LEVELS 3
+#define Z_TILE_SHIFT(level) (3 + 2 * (level))
+
+typedef struct {
+    float min[Z_LEVELS][(RAY_COUNT >> Z_TILE_SHIFT(0)) + 1];
+    float max[Z_LEVELS][(RAY_COUNT >> Z_TILE_SHIFT(0)) + 1];
+    int ray_count;
+} ZPyramid;
+
+ZPyramid g_z_pyramid = {0};
+
+#define MAX_WALL_LAYERS 8 // transparent, short or raised walls a column keeps, nearest first
+Column g_column_layers[RAY_COUNT][MAX_WALL_LAYERS];
+
+// Lighting
+#define LIGHT_LEVELS 16 // brightness steps of the map
+#define DISTANCE_BANDS 32
+#define FOG_DISTANCE 24.0f // map units to the darkest distance band
+#define FOG_STRENGTH 0.7f // how much of the light is lost at FOG_DISTANCE
+#define SHADE_LEVELS 32 // colormaps from black to full brightness
+#define WALL_CONTRAST 5 // vertical faces are this many light levels darker
+
+uint8_t g_colormaps[SHADE_LEVELS][256];
+uint8_t g_shade_levels[LIGHT_LEVELS][DISTANCE_BANDS]; // colormap for a light level seen from a distance band
+
+// A colormap per channel, all three the same unless tinted
+typedef struct {
+    const uint8_t *r;
+    const uint8_t *g;
+    const uint8_t *b;
+    const uint8_t *index; // palette index to shaded palette index, for the indexed renderer
+} Shade;
+
+// Where a sprite lands on the screen
+typedef struct {
+    Texture *texture;
+    Color tint;
+    Shade shade;
+    float depth;
+    int mip;
+    int start_ray; // first column, can be off screen
+    int ray_count;
+    bool partly_hidden; // some of its columns have a wall in front of it
+    SDL_FRect rect;
+} ProjectedSprite;
+
+// What is on the screen from the last frame. When the view is the same only the parts
+// of the screen where sprites or the weapon changed are redrawn, or nothing at all.
+typedef struct {
+    bool valid;
+    bool full_redraw; // the last frame was drawn from scratch
+    // view
+    float x;
+    float y;
+    float angle;
+    float fov;
+    int map_revision;
+    int door_version;
+    int lighting_version;
+    int width;
+    int height;
+    bool map_mode;
+    bool software_render;
+    bool wall_spans;
+    bool interlaced;
+    bool reveal_map;
+    bool indexed_color;
+
+    int weapon_frame;
+    ProjectedSprite *sprites; // back to front
+    ProjectedSprite *next_sprites; // this frame's are collected here, then swapped
+    int sprite_count;
+    int sprite_capacity; // of both
+} FrameCache;
+
+FrameCache g_frame_cache = {0};
+
+// Internal render resolution, changed at runtime by the resolution governor
+typedef struct {
+    int width;
+    int height;
+    int ray_count;
+    float scale; // 1.0 is RESX x RESY
+    bool dynamic; // let the governor change the scale
+    SDL_Texture *fbo;
+    SDL_Texture *wall_layer; // sky and walls without sprites, to redraw sprites over
+
+    // governor
+    double frame_time; // smoothed time spent on a frame, not counting the frame limiter
+    int slow_frames;
+    int fast_frames;
+} RenderState;
+
+RenderState g_render = {
+    .width = RESX,
+    .height = RESY,
+    .ray_count = RAY_COUNT,
+    .scale = 1.0f,
+    .dynamic = true,
+};
 
 
 // func declaration
 RayData cast_ray(float x_start, float y_start, float angle);
+RayData cast_ray_dir(float x_start, float y_start, float dir_x, float dir_y);
+void map_set_cell(int x, int y, int wall_id);
+Door *door_plane(int cell);
+bool blocks_eye_level(int cell);
+bool map_changes_since(int revision, int *cells, int *count);
 
 void init_sdl(SDL_Renderer **renderer, SDL_Window **window, int width, int height) {
     if(!SDL_Init(SDL_INIT_VIDEO)) {
@@ -233,24 +574,131 @@ void init_sdl(SDL_Renderer **renderer, SDL_Window **window, int width, int heigh
     SDL_SetWindowRelativeMouseMode(*window, true);
 }
 
-SDL_Texture *load_texture(SDL_Renderer *r, const char *filepath) {
+// Halve an image with a 2x2 box filter. Colors are weighted by alpha so the
+// transparent parts of sprites don't bleed black into their edges.
+void downsample_image(const uint32_t *src, int src_w, int src_h, uint32_t *dst, int dst_w, int dst_h) {
+    for (int y = 0; y < dst_h; y++) {
+        int y0 = MIN(2*y, src_h - 1), y1 = MIN(2*y + 1, src_h - 1);
+        for (int x = 0; x < dst_w; x++) {
+            int x0 = MIN(2*x, src_w - 1), x1 = MIN(2*x + 1, src_w - 1);
+            uint32_t texels[4] = {
+                src[y0*src_w + x0], src[y0*src_w + x1],
+                src[y1*src_w + x0], src[y1*src_w + x1],
+            };
+            uint32_t r = 0, g = 0, b = 0, a = 0;
+            for (int i = 0; i < 4; i++) {
+                uint32_t alpha = COLOR_A(texels[i]);
+                r += COLOR_R(texels[i]) * alpha;
+                g += COLOR_G(texels[i]) * alpha;
+                b += COLOR_B(texels[i]) * alpha;
+                a += alpha;
+            }
+            dst[y*dst_w + x] = a == 0 ? 0 : PACK_COLOR(r / a, g / a, b / a, a / 4);
+        }
+    }
+}
+
+// smallest shift such that 1 << shift >= n
+int pow2_shift(int n) {
+    int shift = 0;
+    while ((1 << shift) < n) shift++;
+    return shift;
+}
+
+// Transpose a row-major image into columns of 1 << shift texels. The padding at the
+// end of each column repeats the last texel.
+uint32_t *transpose_image(const uint32_t *src, int width, int height, int shift) {
+    const int column_height = 1 << shift;
+    uint32_t *dst = malloc((size_t)width * column_height * sizeof(uint32_t));
+    for (int x = 0; x < width; x++) {
+        uint32_t *column = dst + (x << shift);
+        for (int y = 0; y < height; y++)
+            column[y] = src[y*width + x];
+        for (int y = height; y < column_height; y++)
+            column[y] = column[height - 1];
+    }
+    return dst;
+}
+
+// Make a texture from row-major ABGR8888 pixels, takes ownership of them
+Texture *create_texture(SDL_Renderer *r, uint32_t *pixels, int width, int height) {
+    Texture *texture = calloc(1, sizeof(Texture));
+    texture->width = width;
+    texture->height = height;
+    texture->pixels[0] = pixels;
+
+    // mip chain down to 1x1
+    int level = 0;
+    texture->mip_width[0] = width;
+    texture->mip_height[0] = height;
+    while ((width > 1 || height > 1) && level + 1 < MAX_MIP_LEVELS) {
+        int mip_w = MAX(width / 2, 1), mip_h = MAX(height / 2, 1);
+        level++;
+        texture->pixels[level] = malloc(mip_w * mip_h * sizeof(uint32_t));
+        downsample_image(texture->pixels[level - 1], width, height, texture->pixels[level], mip_w, mip_h);
+        texture->mip_width[level] = width = mip_w;
+        texture->mip_height[level] = height = mip_h;
+    }
+    texture->mip_count = level + 1;
+
+    for (int i = 0; i < texture->mip_count; i++) {
+        int w = texture->mip_width[i], h = texture->mip_height[i];
+        texture->levels[i] = SDL_CreateTexture(r, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STATIC, w, h);
+        bool res = SDL_UpdateTexture(texture->levels[i], NULL, texture->pixels[i], w * sizeof(uint32_t));
+        if (!res) {
+            fprintf(stderr, "%s\n", SDL_GetError());
+        }
+    }
+
+    // the gpu has its copy, keep the cpu one column-major
+    for (int i = 0; i < texture->mip_count; i++) {
+        uint32_t *row_major = texture->pixels[i];
+        texture->mip_shift[i] = pow2_shift(texture->mip_height[i]);
+        texture->pixels[i] = transpose_image(row_major, texture->mip_width[i], texture->mip_height[i],
+                                             texture->mip_shift[i]);
+        free(row_major);
+    }
+
+    return texture;
+}
+
+Texture *load_texture(SDL_Renderer *r, const char *filepath) {
     int width, height, n_channels;
-    uint8_t *data = stbi_load(filepath, &width, &height, &n_channels, 0);
+    uint8_t *data = stbi_load(filepath, &width, &height, &n_channels, 4);
     if (data == NULL) {
-        fprintf(stderr, "Failed to load image %s\n", filepath);
+        PANIC("Failed to load image %s\n", filepath);
     } else {
         printf("Loaded image %s: %dx%dx%d\n", filepath, width, height, n_channels);
     }
-    SDL_PixelFormat format = n_channels == 3 ? SDL_PIXELFORMAT_RGB24 : SDL_PIXELFORMAT_RGBA32;
 
-    SDL_Texture *texture = SDL_CreateTexture(r, format, SDL_TEXTUREACCESS_STATIC, width, height);
-    bool res = SDL_UpdateTexture(texture, NULL, data, width * n_channels);
-    if (!res) {
-        fprintf(stderr, "%s\n", SDL_GetError());
+    uint32_t *pixels = malloc(width * height * sizeof(uint32_t));
+    for (int i = 0; i < width * height; i++) {
+        uint8_t *c = &data[i * 4];
+        pixels[i] = PACK_COLOR(c[0], c[1], c[2], c[3]);
     }
-
     stbi_image_free(data);
-    return texture;
+    return create_texture(r, pixels, width, height);
+}
+
+void destroy_texture(Texture *texture) {
+    for (int i = 0; i < texture->mip_count; i++) {
+        SDL_DestroyTexture(texture->levels[i]);
+        free(texture->pixels[i]);
+        free(texture->indexed[i]);
+    }
+    free(texture);
+}
+
+// Pick the mip level whose height is closest to (but not below) the number of
+// screen pixels the texture gets stretched over
+int texture_mip_level(const Texture *texture, float screen_height) {
+    int level = 0;
+    float texels = texture->height;
+    while (level + 1 < texture->mip_count && texels >= 2.0f * screen_height) {
+        texels *= 0.5f;
+        level++;
+    }
+    return level;
 }
 
 // loads all images in directory into an animated sprite. File names: 0.png 1.png ...;
@@ -258,7 +706,7 @@ SDL_Texture *load_texture(SDL_Renderer *r, const char *filepath) {
 AnimatedSprite load_animated_sprite(SDL_Renderer *r, const char *dirname, int count, float frame_time) {
 
     AnimatedSprite as = {0};
-    as.frames = malloc(sizeof(SDL_Texture *) * count);
+    as.frames = malloc(sizeof(Texture *) * count);
     as.frame_count = count;
     char buf[256];
     for (int i = 0; i < count; i++) {
@@ -267,11 +715,31 @@ AnimatedSprite load_animated_sprite(SDL_Renderer *r, const char *dirname, int co
     }
     as.frame_time = frame_time;
     as.current_frame = 0;
-    as.timer = frame_time;
 
     return as;
 }
 
+// Load count frames from dirname into g_clips
+const AnimationClip *load_animation_clip(SDL_Renderer *r, const char *dirname, int count, float frame_time) {
+    if (g_clip_count == MAX_CLIPS) PANIC("ERROR: Too many animation clips\n");
+    AnimationClip *clip = &g_clips[g_clip_count++];
+    clip->frames = malloc(sizeof(Texture *) * count);
+    clip->frame_count = count;
+    clip->frame_time = frame_time;
+    char buf[256];
+    for (int i = 0; i < count; i++) {
+        sprintf(buf, "%s/%d.png", dirname, i);
+        clip->frames[i] = load_texture(r, buf);
+    }
+    return clip;
+}
+
+// The frame of a clip showing now for an instance phase seconds ahead of the clock
+Texture *clip_frame(const AnimationClip *clip, float phase) {
+    int frame = (int)SDL_floor((e_state.time + phase) / clip->frame_time);
+    return clip->frames[frame % clip->frame_count];
+}
+
 //---Map Loading---
 void load_map_textures(SDL_Renderer *r) {
     // Walls
@@ -283,109 +751,170 @@ void load_map_textures(SDL_Renderer *r) {
     }
     // sky
     g_textures[i++] = load_texture(r, "res/textures/sky.png");
+    // floor
+    g_textures[i++] = load_texture(r, "res/textures/3_old.png");
+
+    // iron bars, made here since there is no image for them
+    const int size = 64;
+    uint32_t *bars = malloc(size * size * sizeof(uint32_t));
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int bar = x % 16; // 4 bars and a rail top and bottom
+            bool solid = (bar >= 6 && bar < 10) || y < 4 || y >= size - 4;
+            int shine = bar >= 6 && bar < 10 ? (bar - 6) * 12 : 0;
+            bars[y * size + x] = solid ? PACK_COLOR(70 + shine, 70 + shine, 80 + shine, 255) : PACK_COLOR(0, 0, 0, 0);
+        }
+    }
+    g_textures[i++] = create_texture(r, bars, size, size);
+
+    // door, planks in a metal frame
+    uint32_t *door = malloc(size * size * sizeof(uint32_t));
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            bool frame = x < 4 || x >= size - 4 || y < 4 || y >= size - 4;
+            bool seam = x % 14 == 4;
+            bool rivet = frame && (x % 12 == 6) && (y == 1 || y == size - 2);
+            int grain = (x * 7 + y / 3) % 9;
+            uint32_t c = PACK_COLOR(110 + grain, 72 + grain, 40, 255);
+            if (seam) c = PACK_COLOR(50, 32, 18, 255);
+            if (frame) c = rivet ? PACK_COLOR(150, 150, 160, 255) : PACK_COLOR(80, 80, 90, 255);
+            door[y * size + x] = c;
+        }
+    }
+    g_textures[i++] = create_texture(r, door, size, size);
+}
+
+#define GROW_ARRAY(a, n) ((a) = realloc((a), (n) * sizeof(*(a))))
+
+int add_object(float x, float y, int id, int light, ObjectSpriteType type, ObjectSprite sprite) {
+    Objects *o = &g_map.objects;
+    if (o->count == o->capacity) {
+        o->capacity = o->capacity ? 2 * o->capacity : 16;
+        GROW_ARRAY(o->x, o->capacity);
+        GROW_ARRAY(o->y, o->capacity);
+        GROW_ARRAY(o->light, o->capacity);
+        GROW_ARRAY(o->id, o->capacity);
+        GROW_ARRAY(o->sprite_type, o->capacity);
+        GROW_ARRAY(o->sprite, o->capacity);
+        GROW_ARRAY(o->phase, o->capacity);
+    }
+    int i = o->count++;
+    o->x[i] = x;
+    o->y[i] = y;
+    o->light[i] = light;
+    o->id[i] = id;
+    o->sprite_type[i] = type;
+    o->sprite[i] = sprite;
+    o->phase[i] = 0;
+    return i;
+}
+
+EnemyHandle spawn_enemy(float x, float y, float radius, int health, const AnimationClip *clip) {
+    Enemies *e = &g_map.enemies;
+    if (e->count == e->capacity) {
+        e->capacity = e->capacity ? 2 * e->capacity : 16;
+        GROW_ARRAY(e->x, e->capacity);
+        GROW_ARRAY(e->y, e->capacity);
+        GROW_ARRAY(e->radius, e->capacity);
+        GROW_ARRAY(e->health, e->capacity);
+        GROW_ARRAY(e->state, e->capacity);
+        GROW_ARRAY(e->hurt_until, e->capacity);
+        GROW_ARRAY(e->alert, e->capacity);
+        GROW_ARRAY(e->cell, e->capacity);
+        GROW_ARRAY(e->sees_player, e->capacity);
+        GROW_ARRAY(e->clip, e->capacity);
+        GROW_ARRAY(e->slot, e->capacity);
+        // there are never more slots than enemies alive at once
+        GROW_ARRAY(e->slot_index, e->capacity);
+        GROW_ARRAY(e->slot_generation, e->capacity);
+    }
+    int slot = e->free_slot;
+    if (slot < 0) {
+        slot = e->slot_count++;
+        e->slot_generation[slot] = 0;
+    } else {
+        e->free_slot = e->slot_index[slot];
+    }
+    int i = e->count++;
+    e->x[i] = x;
+    e->y[i] = y;
+    e->radius[i] = radius;
+    e->health[i] = health;
+    e->state[i] = ENEMY_NORMAL;
+    e->hurt_until[i] = 0;
+    e->alert[i] = false;
+    e->clip[i] = clip;
+    e->slot[i] = slot;
+    e->slot_index[slot] = i;
+    return (EnemyHandle){slot, e->slot_generation[slot]};
+}
+
+// Index of a live enemy, -1 if it has died
+int enemy_index(EnemyHandle h) {
+    const Enemies *e = &g_map.enemies;
+    if (h.slot < 0 || h.slot >= e->slot_count || e->slot_generation[h.slot] != h.generation) return -1;
+    return e->slot_index[h.slot];
+}
+
+// Free enemy i's slot and move the last enemy into its place
+void despawn_enemy_at(int i) {
+    Enemies *e = &g_map.enemies;
+    int slot = e->slot[i];
+    e->slot_generation[slot]++;
+    e->slot_index[slot] = e->free_slot;
+    e->free_slot = slot;
+
+    int last = --e->count;
+    if (i == last) return;
+    #define MOVE_FIELD(a) (e->a[i] = e->a[last])
+    MOVE_FIELD(x); MOVE_FIELD(y); MOVE_FIELD(radius); MOVE_FIELD(health);
+    MOVE_FIELD(state); MOVE_FIELD(hurt_until); MOVE_FIELD(alert); MOVE_FIELD(clip); MOVE_FIELD(slot);
+    #undef MOVE_FIELD
+    e->slot_index[e->slot[i]] = i;
+}
+
+void despawn_enemy(EnemyHandle h) {
+    int i = enemy_index(h);
+    if (i >= 0) despawn_enemy_at(i);
 }
 
 // loads all the map objects into the global map struct
 void load_map_objects(SDL_Renderer *r) {
-    // candlebra
-    Object objects[128];
-    int count = 0;
-
     int id = 0;
-    SDL_Texture *candlebra = load_texture(r, "res/sprites/static_sprites/candlebra.png");
+    // candlebra
+    Texture *candlebra = load_texture(r, "res/sprites/static_sprites/candlebra.png");
     id++;
-    objects[count++] = (Object) {
-        .x = 4.5f,
-        .y = 5.5f,
-        .id = id,
-        .sprite_type = OBJECT_STATIC,
-        .sprite.static_frame = candlebra,
-    };
+    add_object(4.5f, 5.5f, id, 0, OBJECT_STATIC, (ObjectSprite){.static_frame = candlebra});
 
-    Object obj = {0};
     // green light
-    AnimatedSprite green_light = load_animated_sprite(r, "res/sprites/animated_sprites/green_light", 4, ANIM_FRAME_TIME);
+    const AnimationClip *green_light = load_animation_clip(r, "res/sprites/animated_sprites/green_light", 4, ANIM_FRAME_TIME);
     id++;
-    obj.x = 4.0f;
-    obj.y = 3.0f;
-    obj.id = id;
-    obj.sprite_type = OBJECT_ANIMATED;
-    obj.sprite.animated = green_light;
-    objects[count++] = obj;
-
-    // red light
-    AnimatedSprite red_light = load_animated_sprite(r, "res/sprites/animated_sprites/red_light", 4, ANIM_FRAME_TIME);
+    add_object(4.0f, 3.0f, id, 10, OBJECT_ANIMATED, (ObjectSprite){.clip = green_light});
+
+    // red lights
+    const AnimationClip *red_light = load_animation_clip(r, "res/sprites/animated_sprites/red_light", 4, ANIM_FRAME_TIME);
     id++;
-    obj.x = 9.5f;
-    obj.y = 3.5f;
-    obj.id = id;
-    obj.sprite_type = OBJECT_ANIMATED;
-    obj.sprite.animated = red_light;
-    objects[count++] = obj;
-
-    obj.x = 10.5f;
-    obj.y = 3.5f;
-    objects[count++] = obj;
-
-    obj.x = 9.5f;
-    obj.y = 4.5f;
-    objects[count++] = obj;
-
-    obj.x = 10.5f;
-    obj.y = 4.5f;
-    objects[count++] = obj;
-
-    g_map.objects = malloc(count * sizeof(Object));
-    memcpy(g_map.objects, objects, count * sizeof(Object));
-    g_map.object_count = count;
+    add_object(9.5f, 3.5f, id, 8, OBJECT_ANIMATED, (ObjectSprite){.clip = red_light});
+    add_object(10.5f, 3.5f, id, 8, OBJECT_ANIMATED, (ObjectSprite){.clip = red_light});
+    add_object(9.5f, 4.5f, id, 8, OBJECT_ANIMATED, (ObjectSprite){.clip = red_light});
+    add_object(10.5f, 4.5f, id, 8, OBJECT_ANIMATED, (ObjectSprite){.clip = red_light});
+
     g_map.object_type_count = id;
 }
 
 void load_map_enemies(SDL_Renderer *r) {
-
-    Enemy enemies[128];
-    int count = 0;
-
-    Enemy e = {
-        .x = 8,
-        .y = 7,
-        .radius = 0.5f,
-        .health = 100,
-        .dead = false,
-        .damage = 0,
-        .state = ENEMY_NORMAL,
-        .sprite = load_animated_sprite(r, "res/sprites/npc/amog", 1, 1),
-    };
-    enemies[count++] = e;
-    e.x++;
-    enemies[count++] = e;
-    e.x++;
-    enemies[count++] = e;
-    e.y = 1.5f;
-    enemies[count++] = e;
-    e.x--;
-    enemies[count++] = e;
-    e.x--;
-    enemies[count++] = e;
+    g_map.enemies.free_slot = -1;
+    const AnimationClip *amog = load_animation_clip(r, "res/sprites/npc/amog", 1, 1);
+    for (int x = 8; x <= 10; x++) spawn_enemy(x, 7, 0.5f, 100, amog);
+    for (int x = 10; x >= 8; x--) spawn_enemy(x, 1.5f, 0.5f, 100, amog);
 
     // hidden
-    e.y = 10;
-    e.x = 3;
-    enemies[count++] = e;
-    e.x++;
-    enemies[count++] = e;
+    spawn_enemy(3, 10, 0.5f, 100, amog);
+    spawn_enemy(4, 10, 0.5f, 100, amog);
 
     // chunker
-    e.x = 10;
-    e.y = 4;
-    e.health = 600;
-    e.sprite = load_animated_sprite(r, "res/sprites/npc/vsauce", 1, 1);
-    e.radius = 0.7f;
-    enemies[count++] = e;
-
-    g_map.enemies = malloc(count * sizeof(Enemy));
-    memcpy(g_map.enemies, enemies, count * sizeof(Enemy));
-    g_map.enemy_count = count;
+    const AnimationClip *vsauce = load_animation_clip(r, "res/sprites/npc/vsauce", 1, 1);
+    spawn_enemy(10, 4, 0.7f, 600, vsauce);
 }
 
 void create_map(SDL_Renderer *r) {
@@ -406,7 +935,7 @@ void create_map(SDL_Renderer *r) {
         2, 0, 0, 0, 0, 0, 0, 0, 4, 4, 4, 4, 0, 2,
         2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
         2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
-        2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 2, 2, 2, 2,
+        2, 2, 8, 8, 8, 8, 2, 2, 9, 2, 2, 2, 2, 2,
         2, 0, 0, 0, 0, 0, 0, 2, 0, 0, 2, 5, 5, 2,
         2, 0, 0, 0, 0, 0, 0, 2, 0, 0, 2, 0, 0, 2,
         2, 0, 0, 3, 3, 0, 0, 2, 0, 0, 2, 0, 0, 2,
@@ -418,8 +947,73 @@ void create_map(SDL_Renderer *r) {
     g_map.map = malloc(num_bytes);
     memcpy(g_map.map, map_layout, num_bytes);
 
-    g_map.x_scale = (float)RESX / g_map.width;
-    g_map.y_scale = (float)RESY / g_map.height;
+    // heights, everything else is a full height wall
+    g_map.floor_height = calloc(g_map.width*g_map.height, sizeof(float));
+    g_map.ceiling_height = malloc(g_map.width*g_map.height * sizeof(float));
+    for (int i = 0; i < g_map.width*g_map.height; i++) g_map.ceiling_height[i] = 1.0f;
+    const struct { int x, y, count; float floor, ceiling; } heights[] = {
+        {8, 2, 3, 0.65f, 1.0f}, // beam
+        {3, 4, 3, 0.0f, 0.35f}, // low wall
+        {3, 11, 2, 0.0f, 0.6f}, // pillars
+        {3, 12, 2, 0.0f, 0.6f},
+    };
+    for (int i = 0; i < (int)(sizeof(heights) / sizeof(heights[0])); i++) {
+        for (int x = heights[i].x; x < heights[i].x + heights[i].count; x++) {
+            g_map.floor_height[heights[i].y*g_map.width + x] = heights[i].floor;
+            g_map.ceiling_height[heights[i].y*g_map.width + x] = heights[i].ceiling;
+        }
+    }
+    g_map.max_height = 1.0f;
+    for (int i = 0; i < g_map.width*g_map.height; i++) {
+        if (g_map.map[i] != 0) g_map.max_height = MAX(g_map.max_height, g_map.ceiling_height[i]);
+    }
+
+    // doors, and the walls that can be pushed
+    const int push_walls[][2] = {{7, 10}};
+    const int push_count = sizeof(push_walls) / sizeof(push_walls[0]);
+    g_map.door_index = malloc(g_map.width*g_map.height * sizeof(int));
+    int door_count = push_count;
+    for (int i = 0; i < g_map.width*g_map.height; i++) {
+        g_map.door_index[i] = -1;
+        if (g_map.map[i] == TEXTURE_DOOR) door_count++;
+    }
+    g_map.doors = calloc(door_count, sizeof(Door));
+    g_map.active_doors = malloc(door_count * sizeof(int));
+    for (int i = 0; i < g_map.width*g_map.height; i++) {
+        if (g_map.map[i] != TEXTURE_DOOR) continue;
+        // runs between the walls on either side, on the edge of the map only the cells above and below can be checked
+        int x = i % g_map.width, y = i / g_map.width;
+        bool along_x;
+        if (x > 0 && x < g_map.width - 1) along_x = g_map.map[i - 1] != 0 && g_map.map[i + 1] != 0;
+        else along_x = !(y > 0 && y < g_map.height - 1 && g_map.map[i - g_map.width] != 0 && g_map.map[i + g_map.width] != 0);
+        g_map.door_index[i] = g_map.door_count;
+        g_map.doors[g_map.door_count++] = (Door){
+            .kind = DOOR_SLIDING,
+            .cell = i,
+            .orient = along_x ? WALL_HORIZONTAL : WALL_VERTICAL,
+            .offset = 0.5f,
+        };
+    }
+    for (int i = 0; i < push_count; i++) {
+        int cell = push_walls[i][1] * g_map.width + push_walls[i][0];
+        g_map.door_index[cell] = g_map.door_count;
+        g_map.doors[g_map.door_count++] = (Door){
+            .kind = DOOR_PUSH_WALL,
+            .cell = cell,
+            .cells_left = PUSH_WALL_CELLS,
+        };
+    }
+    g_map.light = 5;
+    g_map.light_grid = calloc(g_map.width*g_map.height, sizeof(uint8_t));
+    g_map.light_sum = calloc(g_map.width*g_map.height, sizeof(uint16_t));
+    g_map.light_steps = calloc(g_map.width*g_map.height, sizeof(int));
+    g_map.light_queue = malloc(g_map.width*g_map.height * sizeof(int));
+    g_map.seen = calloc((g_map.width*g_map.height + 31) / 32, sizeof(uint32_t));
+    g_map.revealed = malloc(g_map.width*g_map.height * sizeof(int));
+    g_map.revealed_count = 0;
+
+    g_map.x_scale = (float)g_render.width / g_map.width;
+    g_map.y_scale = (float)g_render.height / g_map.height;
 
     // load player weapon
     // Format of dir: (Idle)0.png, (Shoot)..., (Reload)...
@@ -444,32 +1038,353 @@ void destroy_map() {
     // A different options would be to store all sprites together in a seperate array when a new one is loaded
     // and then just loop through that array.
     for (int t = 0; t < g_map.object_type_count; t++) {
-        for (int i = 0; i < g_map.object_count; i++) {
-            Object obj = g_map.objects[i];
-            if (obj.id != t) continue;
+        for (int i = 0; i < g_map.objects.count; i++) {
+            if (g_map.objects.id[i] != t) continue;
 
-            if (obj.sprite_type == OBJECT_STATIC) {
-                SDL_DestroyTexture(obj.sprite.static_frame);
-            } else {
-                for (int j = 0; j < obj.sprite.animated.frame_count; j++) {
-                    SDL_DestroyTexture(obj.sprite.animated.frames[j]);
-                }
-                free(obj.sprite.animated.frames);
-            }
+            if (g_map.objects.sprite_type[i] == OBJECT_STATIC) destroy_texture(g_map.objects.sprite[i].static_frame);
             break;
         }
     }
-    // unload enemies
+    // animations, enemies only use clips
+    for (int i = 0; i < g_clip_count; i++) {
+        for (int j = 0; j < g_clips[i].frame_count; j++) destroy_texture(g_clips[i].frames[j]);
+        free(g_clips[i].frames);
+    }
+    g_clip_count = 0;
+
+    // walls and sky
+    for (int i = 0; i < MAX_TEXTURES; i++) {
+        if (g_textures[i]) destroy_texture(g_textures[i]);
+    }
 
     // weapon
     for (int i = 0; i < player.weapon.sprite.frame_count; i++) {
-        SDL_DestroyTexture(player.weapon.sprite.frames[i]);
+        destroy_texture(player.weapon.sprite.frames[i]);
     }
     free(player.weapon.sprite.frames);
 
     // free map
+    if (g_map.grid) SDL_DestroyTexture(g_map.grid);
+    if (g_map.automap) SDL_DestroyTexture(g_map.automap);
+    free(g_map.seen);
+    free(g_map.revealed);
+    for (int i = 0; i < g_map.light_count; i++) free(g_map.lights[i].cells);
+    free(g_map.lights);
+    free(g_map.light_grid);
+    free(g_map.light_sum);
+    free(g_map.light_steps);
+    free(g_map.light_queue);
     free(g_map.map);
-    free(g_map.objects);
+    free(g_map.floor_height);
+    free(g_map.ceiling_height);
+    free(g_map.doors);
+    free(g_map.door_index);
+    free(g_map.active_doors);
+
+    Objects *o = &g_map.objects;
+    free(o->x); free(o->y); free(o->light); free(o->id); free(o->sprite_type); free(o->sprite); free(o->phase);
+    Enemies *e = &g_map.enemies;
+    free(e->x); free(e->y); free(e->radius); free(e->health); free(e->state); free(e->hurt_until); free(e->alert); free(e->clip);
+    free(e->cell); free(e->sees_player);
+    free(e->slot); free(e->slot_index); free(e->slot_generation);
+    free(g_map.flow_next);
+    free(g_map.flow_blocked);
+    free(g_map.flow_queue);
+}
+
+//---Timers---
+// Events due after a delay, kept in a hierarchical timer wheel. Each level has
+// TIMER_SLOTS lists covering TIMER_SLOTS times the ticks of the level below; a timer
+// goes in the lowest level its delay fits and moves down as the wheel turns, so a tick
+// only touches the timers due in it.
+#define TIMER_TICK (1.0 / 60.0) // seconds
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 3 // longest delay is TIMER_SLOTS^3 ticks, about 72 minutes
+
+typedef enum {
+    TIMER_ENEMY_HURT, // hurt enemy goes back to normal
+    TIMER_WEAPON_FRAME, // next frame of the firing or reload animation
+} TimerEvent;
+
+typedef struct {
+    TimerEvent event;
+    uint32_t expires; // tick
+    EnemyHandle enemy;
+    int next; // in its slot or the free list
+} Timer;
+
+typedef struct {
+    Timer *timers;
+    int capacity;
+    int free; // -1 when all are in use
+    int pending; // scheduled and not run yet
+    int slots[TIMER_LEVELS][TIMER_SLOTS]; // first timer of each list, -1 if empty
+    uint32_t now; // last tick run
+} TimerWheel;
+
+TimerWheel g_timers = {.free = -1};
+
+void timer_wheel_insert(int t) {
+    Timer *timer = &g_timers.timers[t];
+    uint32_t delay = timer->expires - g_timers.now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delay >= 1u << (TIMER_BITS * (level + 1))) level++;
+    int *slot = &g_timers.slots[level][(timer->expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->next = *slot;
+    *slot = t;
+}
+
+// Run event after delay seconds, returns the tick it will run on
+uint32_t schedule_timer(TimerEvent event, double delay, EnemyHandle enemy) {
+    if (g_timers.free < 0) {
+        int old = g_timers.capacity;
+        if (old == 0) memset(g_timers.slots, -1, sizeof(g_timers.slots));
+        g_timers.capacity = old ? 2 * old : 64;
+        GROW_ARRAY(g_timers.timers, g_timers.capacity);
+        for (int i = old; i < g_timers.capacity; i++) g_timers.timers[i].next = i + 1 < g_timers.capacity ? i + 1 : -1;
+        g_timers.free = old;
+    }
+    int t = g_timers.free;
+    g_timers.free = g_timers.timers[t].next;
+
+    const uint32_t max_delay = (1u << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    uint32_t ticks = (uint32_t)MIN(MAX(SDL_ceil(delay / TIMER_TICK), 1.0), (double)max_delay);
+    g_timers.timers[t] = (Timer){.event = event, .expires = g_timers.now + ticks, .enemy = enemy};
+    timer_wheel_insert(t);
+    g_timers.pending++;
+    return g_timers.timers[t].expires;
+}
+
+void run_timer(const Timer *timer) {
+    Weapon *weapon = &player.weapon;
+    switch (timer->event) {
+        case TIMER_ENEMY_HURT: {
+            // skip it if the enemy died or was hurt again since
+            int i = enemy_index(timer->enemy);
+            if (i >= 0 && g_map.enemies.hurt_until[i] == timer->expires) g_map.enemies.state[i] = ENEMY_NORMAL;
+        } break;
+        case TIMER_WEAPON_FRAME:
+            weapon->sprite.current_frame++;
+            if (weapon->state == WEAPON_FIRE && weapon->sprite.current_frame > weapon->shoot_frame_count) {
+                weapon->sprite.current_frame = 0;
+                weapon->state = WEAPON_IDLE;
+            } else if (weapon->state == WEAPON_RELOAD && weapon->sprite.current_frame == weapon->sprite.frame_count) {
+                weapon->ammo = weapon->max_ammo;
+                weapon->sprite.current_frame = 0;
+                weapon->state = WEAPON_IDLE;
+            } else {
+                schedule_timer(TIMER_WEAPON_FRAME, weapon->sprite.frame_time, (EnemyHandle){-1, 0});
+            }
+        break;
+    }
+}
+
+// Run every tick up to the game clock. Called once a frame.
+void update_timers() {
+    uint32_t target = (uint32_t)(e_state.time / TIMER_TICK);
+    if (g_timers.pending == 0) g_timers.now = target; // nothing to run on the way
+    while (g_timers.now != target) {
+        g_timers.now++;
+        // when a level wraps, the next slot of the level above is spread into the ones below
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if (g_timers.now & ((1u << (TIMER_BITS * level)) - 1)) break;
+            int *slot = &g_timers.slots[level][(g_timers.now >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+            int t = *slot;
+            *slot = -1;
+            while (t >= 0) {
+                int next = g_timers.timers[t].next;
+                timer_wheel_insert(t);
+                t = next;
+            }
+        }
+        // taken off first, running them can schedule more
+        int *slot = &g_timers.slots[0][g_timers.now & (TIMER_SLOTS - 1)];
+        int t = *slot;
+        *slot = -1;
+        while (t >= 0) {
+            Timer timer = g_timers.timers[t];
+            g_timers.timers[t].next = g_timers.free;
+            g_timers.free = t;
+            g_timers.pending--;
+            run_timer(&timer);
+            t = timer.next;
+        }
+    }
+}
+
+void free_timers() {
+    free(g_timers.timers);
+    g_timers = (TimerWheel){.free = -1};
+}
+
+//---Doors---
+#define DOOR_OPEN_TIME 1.0f // seconds to slide all the way open
+#define DOOR_STAY_TIME 3.0f // how long a door stays open before closing
+#define DOOR_PASSABLE 0.8f // how far a door has to be open to walk through
+#define PUSH_WALL_SPEED 1.0f // cells per second
+#define USE_DISTANCE 1.0f // how far away doors can be used from
+
+// The door in a cell if it is drawn as a plane, push walls only while they move
+Door *door_plane(int cell) {
+    int index = g_map.door_index[cell];
+    if (index < 0) return NULL;
+    Door *door = &g_map.doors[index];
+    if (door->kind == DOOR_PUSH_WALL && door->state == DOOR_CLOSED) return NULL;
+    return door;
+}
+
+// Walls, and doors that aren't open far enough to walk through
+bool blocks_movement(int cell) {
+    if (g_map.map[cell] == 0) return false;
+    int index = g_map.door_index[cell];
+    if (index < 0 || g_map.doors[index].kind != DOOR_SLIDING) return true;
+    return g_map.doors[index].open < DOOR_PASSABLE;
+}
+
+bool player_in_cell(int cell) {
+    int x = cell % g_map.width, y = cell / g_map.width;
+    return player.x + player.radius > x && player.x - player.radius < x + 1 &&
+           player.y + player.radius > y && player.y - player.radius < y + 1;
+}
+
+// Enemies only care which cell they are in, a wall closing on it would trap them
+bool enemy_in_cell(int cell) {
+    const Enemies *e = &g_map.enemies;
+    for (int i = 0; i < e->count; i++) {
+        if ((int)e->y[i] * g_map.width + (int)e->x[i] == cell) return true;
+    }
+    return false;
+}
+
+// Record that a door moved, only what is drawn from it changed
+void door_moved(Door *door) {
+    door->moved = ++g_map.door_version;
+}
+
+void activate_door(int index) {
+    Door *door = &g_map.doors[index];
+    if (door->active) return;
+    door->active = true;
+    g_map.active_doors[g_map.active_count++] = index;
+}
+
+// The cell a push wall moves into next, -1 if it can't
+int push_wall_next(const Door *door) {
+    int x = door->cell % g_map.width, y = door->cell / g_map.width;
+    if (door->orient == WALL_VERTICAL) x += door->direction;
+    else y += door->direction;
+    if (x < 0 || x >= g_map.width || y < 0 || y >= g_map.height) return -1;
+    int next = y * g_map.width + x;
+    if (g_map.map[next] != 0) return -1;
+    return next;
+}
+
+// Open or close the door the player is facing, or push the wall they are facing
+void use_door() {
+    float dir_x = SDL_cos(player.angle * DEG2RAD), dir_y = SDL_sin(player.angle * DEG2RAD);
+    int cell = -1;
+    for (float d = 0.0f; d <= USE_DISTANCE; d += 0.1f) {
+        int x = player.x + dir_x * d, y = player.y + dir_y * d;
+        if (x < 0 || x >= g_map.width || y < 0 || y >= g_map.height) return;
+        cell = y * g_map.width + x;
+        if (g_map.map[cell] != 0) break;
+    }
+    if (cell < 0 || g_map.door_index[cell] < 0) return;
+
+    int index = g_map.door_index[cell];
+    Door *door = &g_map.doors[index];
+    if (door->kind == DOOR_SLIDING) {
+        bool opening = door->state == DOOR_CLOSED || door->state == DOOR_CLOSING;
+        door->state = opening ? DOOR_OPENING : DOOR_CLOSING;
+        activate_door(index);
+        return;
+    }
+
+    // push walls move once, along whichever axis the player is facing down
+    if (door->state != DOOR_CLOSED) return;
+    bool along_x = SDL_fabsf(dir_x) > SDL_fabsf(dir_y);
+    door->orient = along_x ? WALL_VERTICAL : WALL_HORIZONTAL;
+    door->direction = (along_x ? dir_x : dir_y) > 0 ? 1 : -1;
+    if (push_wall_next(door) < 0) return;
+    door->state = DOOR_OPENING;
+    door->open = 0.0f;
+    door->offset = door->direction > 0 ? 0.0f : 1.0f;
+    activate_door(index);
+    door_moved(door);
+}
+
+// returns true when the door has stopped
+bool update_sliding_door(Door *door) {
+    const bool blocked = blocks_movement(door->cell);
+    const float step = e_state.delta_time / DOOR_OPEN_TIME;
+    switch (door->state) {
+        case DOOR_OPENING:
+            door->open = MIN(door->open + step, 1.0f);
+            if (door->open >= 1.0f) {
+                door->state = DOOR_OPEN;
+                door->timer = DOOR_STAY_TIME;
+            }
+        break;
+        case DOOR_OPEN:
+            door->timer -= e_state.delta_time;
+            if (door->timer <= 0) door->state = DOOR_CLOSING;
+        return false;
+        case DOOR_CLOSING:
+            // don't close on the player or an enemy
+            if (player_in_cell(door->cell) || enemy_in_cell(door->cell)) {
+                door->state = DOOR_OPENING;
+                return false;
+            }
+            door->open = MAX(door->open - step, 0.0f);
+            if (door->open <= 0.0f) door->state = DOOR_CLOSED;
+        break;
+        default:
+    }
+    door_moved(door);
+    // journal it only when it starts or stops blocking, not every frame it moves
+    if (blocks_movement(door->cell) != blocked)
+        map_set_cell(door->cell % g_map.width, door->cell / g_map.width, g_map.map[door->cell]);
+    return door->state == DOOR_CLOSED;
+}
+
+// Push walls move their face through the cell, then move into the next cell
+bool update_push_wall(Door *door) {
+    int next = push_wall_next(door);
+    if (next < 0 || player_in_cell(next) || enemy_in_cell(next)) return false;
+
+    door->open += e_state.delta_time * PUSH_WALL_SPEED;
+    if (door->open >= 1.0f) {
+        int index = g_map.door_index[door->cell];
+        int wall_id = g_map.map[door->cell];
+        map_set_cell(door->cell % g_map.width, door->cell / g_map.width, 0);
+        map_set_cell(next % g_map.width, next / g_map.width, wall_id);
+        g_map.door_index[door->cell] = -1;
+        door->cell = next;
+        door->open = 0.0f;
+        door->cells_left--;
+        if (door->cells_left == 0 || push_wall_next(door) < 0) {
+            // a normal wall from now on
+            door->state = DOOR_CLOSED;
+            return true;
+        }
+        g_map.door_index[next] = index;
+        next = push_wall_next(door);
+    }
+    door->offset = door->direction > 0 ? door->open : 1.0f - door->open;
+    door_moved(door);
+    return false;
+}
+
+// Move the doors that are active, doors that aren't cost nothing
+void update_doors() {
+    for (int i = 0; i < g_map.active_count; i++) {
+        Door *door = &g_map.doors[g_map.active_doors[i]];
+        bool stopped = door->kind == DOOR_SLIDING ? update_sliding_door(door) : update_push_wall(door);
+        if (!stopped) continue;
+        door->active = false;
+        g_map.active_doors[i--] = g_map.active_doors[--g_map.active_count];
+    }
 }
 
 bool check_collision_circle_line(float cx, float cy, float radius, float p1x, float p1y, float p2x, float p2y) {
@@ -492,29 +1407,40 @@ bool check_collision_circle_line(float cx, float cy, float radius, float p1x, fl
 #define SHOTGUN_RAYS 12
 #define SHOTGUN_SPREAD 6.0f
 
+void reload_weapon() {
+    if (player.weapon.state != WEAPON_IDLE || player.weapon.ammo == player.weapon.max_ammo) return;
+    player.weapon.state = WEAPON_RELOAD;
+    player.weapon.sprite.current_frame = player.weapon.shoot_frame_count + 1;
+    schedule_timer(TIMER_WEAPON_FRAME, player.weapon.sprite.frame_time, (EnemyHandle){-1, 0});
+}
+
 // only shotgun rn
 void fire_weapon() {
     if (player.weapon.state != WEAPON_IDLE) return;
     if (player.weapon.ammo <= 0) {
-        player.weapon.state = WEAPON_RELOAD;
+        reload_weapon();
         return;
     }
 
     // shoot
     float angle_step = SHOTGUN_SPREAD / SHOTGUN_RAYS;
     float start_angle = player.angle - SHOTGUN_SPREAD / 2.0f;
-    for (int i = 0; i < g_map.enemy_count; i++) {
-        Enemy enemy = g_map.enemies[i];
+    float hit_x[SHOTGUN_RAYS], hit_y[SHOTGUN_RAYS];
+    for (int r = 0; r < SHOTGUN_RAYS; r++) {
+        RayData ray_data = cast_ray(player.x, player.y, start_angle + r * angle_step);
+        hit_x[r] = ray_data.x;
+        hit_y[r] = ray_data.y;
+    }
+    Enemies *e = &g_map.enemies;
+    for (int i = 0; i < e->count; i++) {
         for (int r = 0; r < SHOTGUN_RAYS; r++) {
-            float angle = start_angle + r * angle_step;
-            RayData ray_data = cast_ray(player.x, player.y, angle);
             if (check_collision_circle_line(
-                enemy.x, enemy.y, enemy.radius,
-                player.x, player.y, ray_data.x, ray_data.y)
+                e->x[i], e->y[i], e->radius[i],
+                player.x, player.y, hit_x[r], hit_y[r])
             ) {
-                g_map.enemies[i].state = ENEMY_HURT;
-                g_map.enemies[i].timer = 0.6f;
-                g_map.enemies[i].health -= player.weapon.base_damage;
+                e->state[i] = ENEMY_HURT;
+                e->hurt_until[i] = schedule_timer(TIMER_ENEMY_HURT, 0.6, (EnemyHandle){e->slot[i], e->slot_generation[e->slot[i]]});
+                e->health[i] -= player.weapon.base_damage;
                 break;
             }
         }
@@ -523,6 +1449,8 @@ void fire_weapon() {
     player.weapon.ammo--;
 
     player.weapon.state = WEAPON_FIRE;
+    player.weapon.sprite.current_frame = 1;
+    schedule_timer(TIMER_WEAPON_FRAME, player.weapon.sprite.frame_time, (EnemyHandle){-1, 0});
 }
 
 void handle_events() {
@@ -533,17 +1461,38 @@ void handle_events() {
     while(SDL_PollEvent(&e)) {
         if (e.type == SDL_EVENT_QUIT ||
             (e.type == SDL_EVENT_KEY_DOWN && e.key.key == SDLK_ESCAPE)) e_state.quit = true;
+        if (e.type == SDL_EVENT_WINDOW_EXPOSED) e_state.redraw = true;
 
         // Keyboards event
         if (e.type == SDL_EVENT_KEY_DOWN) {
             switch (e.key.scancode) {
                 case SDL_SCANCODE_R:
-                    if (player.weapon.ammo < player.weapon.max_ammo)
-                        player.weapon.state = WEAPON_RELOAD;
+                    reload_weapon();
                 break;
                 case SDL_SCANCODE_M:
                     e_state.map_mode = !e_state.map_mode;
                 break;
+                case SDL_SCANCODE_E:
+                    use_door();
+                break;
+                case SDL_SCANCODE_F1:
+                    e_state.software_render = !e_state.software_render;
+                break;
+                case SDL_SCANCODE_F2:
+                    e_state.wall_spans = !e_state.wall_spans;
+                break;
+                case SDL_SCANCODE_F3:
+                    g_render.dynamic = !g_render.dynamic;
+                break;
+                case SDL_SCANCODE_F4:
+                    e_state.interlaced = !e_state.interlaced;
+                break;
+                case SDL_SCANCODE_F5:
+                    e_state.reveal_map = !e_state.reveal_map;
+                break;
+                case SDL_SCANCODE_F6:
+                    e_state.indexed_color = !e_state.indexed_color;
+                break;
                 case SDL_SCANCODE_LCTRL:
                     fire_weapon();
                 break;
@@ -568,19 +1517,19 @@ void player_collide() {
     int cell_x;
     int cell_y;
     cell_y = (int)(player.y - player.radius);
-    if (g_map.map[cell_y*g_map.width + (int)player.x] != 0)
+    if (blocks_movement(cell_y*g_map.width + (int)player.x))
         player.y = (cell_y + 1) + player.radius; // need to add one since cell coords are top left
 
     cell_y = (int)(player.y + player.radius);
-    if (g_map.map[cell_y*g_map.width + (int)player.x] != 0)
+    if (blocks_movement(cell_y*g_map.width + (int)player.x))
         player.y = cell_y - player.radius;
 
     cell_x = (int)(player.x + player.radius);
-    if (g_map.map[(int)player.y*g_map.width + cell_x] != 0)
+    if (blocks_movement((int)player.y*g_map.width + cell_x))
         player.x = cell_x - player.radius;
 
     cell_x = (int)(player.x - player.radius);
-    if (g_map.map[(int)player.y*g_map.width + cell_x] != 0)
+    if (blocks_movement((int)player.y*g_map.width + cell_x))
         player.x = (cell_x + 1) + player.radius;
 }
 
@@ -635,437 +1584,2344 @@ void handle_player_input() {
 
 }
 
-void update_animations() {
-    // Objects 
-    for (int i = 0; i < g_map.object_count; i++) {
-        Object *obj = &g_map.objects[i];
-        if (obj->sprite_type == OBJECT_STATIC) continue;
-        obj->sprite.animated.timer -= e_state.delta_time;
-        if (obj->sprite.animated.timer <= 0) {
-            obj->sprite.animated.current_frame++;
-            obj->sprite.animated.current_frame %= obj->sprite.animated.frame_count;
-            obj->sprite.animated.timer = obj->sprite.animated.frame_time;
+// Bring a table of flag(cell) for every cell up to date with the map. Only the cells in the
+// journal since *revision are looked at, unless all is set or the journal doesn't go back
+// that far. Returns true if any flag changed.
+bool sync_cell_flags(uint8_t *flags, int *revision, bool (*flag)(int cell), bool all) {
+    int changed[MAP_JOURNAL_SIZE], count;
+    bool any = false;
+    if (all || !map_changes_since(*revision, changed, &count)) {
+        for (int i = 0; i < g_map.width * g_map.height; i++) flags[i] = flag(i);
+        any = true;
+    } else {
+        for (int i = 0; i < count; i++) {
+            bool f = flag(changed[i]);
+            any |= flags[changed[i]] != f;
+            flags[changed[i]] = f;
         }
     }
+    *revision = g_map.revision;
+    return any;
+}
 
-    // Enemies
+//---Line of sight---
+// Whether the middle of a cell can see the middle of the player's cell. Answers are
+// kept per cell until the player changes cell or a cell starts or stops blocking sight,
+// which starts a new epoch. Cells asked about that haven't been answered this epoch are traced together,
+// LOS_LANES at a time with vector extensions.
+#define LOS_LANES 8
+typedef float LosFloat __attribute__((vector_size(LOS_LANES * sizeof(float))));
+typedef int LosInt __attribute__((vector_size(LOS_LANES * sizeof(int))));
+#define LOS_SELECT(mask, a, b) (((mask) & (a)) | (~(mask) & (b))) // on LosInt
 
-    // Gun
-    switch (player.weapon.state) {
-        case WEAPON_FIRE:
-            if (player.weapon.sprite.current_frame == 0)
-                player.weapon.sprite.current_frame = 1;
-            player.weapon.sprite.timer -= e_state.delta_time;
-            if (player.weapon.sprite.timer <= 0) {
-                player.weapon.sprite.current_frame++;
-                player.weapon.sprite.timer = player.weapon.sprite.frame_time;
-                // past fire animations
-                if (player.weapon.sprite.current_frame > player.weapon.shoot_frame_count) {
-                    player.weapon.sprite.current_frame = 0;
-                    player.weapon.sprite.timer = player.weapon.sprite.frame_time;
-                    player.weapon.state = WEAPON_IDLE;
-                }
-            }
-        break;
-        case WEAPON_RELOAD:
-            if (player.weapon.sprite.current_frame == 0)
-                player.weapon.sprite.current_frame = player.weapon.shoot_frame_count + 1;
-            player.weapon.sprite.timer -= e_state.delta_time;
-            if (player.weapon.sprite.timer <= 0) {
-                player.weapon.sprite.current_frame++;
-                player.weapon.sprite.timer = player.weapon.sprite.frame_time;
-                // past fire animations
-                if (player.weapon.sprite.current_frame == player.weapon.sprite.frame_count) {
-                    player.weapon.ammo = player.weapon.max_ammo;
-                    player.weapon.sprite.current_frame = 0;
-                    player.weapon.sprite.timer = player.weapon.sprite.frame_time;
-                    player.weapon.state = WEAPON_IDLE;
-                }
-            }
-        break;
-        case WEAPON_IDLE:
-        break;
-    }
+typedef struct {
+    uint8_t *blocks; // cells sight can't pass
+    uint8_t *visible;
+    uint32_t *epoch; // epoch each cell's answer is from
+    uint32_t current;
+    int player_cell;
+    int revision; // map revision blocks is up to date with
+    int size;
+    int *pending; // cells to trace
+} LosCache;
+
+LosCache g_los = {0};
+
+// open doors can be seen through
+bool blocks_sight(int cell) {
+    return blocks_eye_level(cell) && blocks_movement(cell);
 }
 
-void update_enemies() {
-    for (int i = 0; i < g_map.enemy_count; i++) {
-        Enemy *e = &g_map.enemies[i];
-        if (e->state == ENEMY_HURT) {
-            e->timer -= e_state.delta_time;
-            if (e->timer <= 0) e->state = ENEMY_NORMAL;
-        }
-        if (e->health <=0 )
-            e->dead = true;
-    }
-
-}
-
-// https://gist.github.com/Gumichan01/332c26f6197a432db91cc4327fcabb1c
-int render_fill_circle(SDL_Renderer *renderer, int x, int y, int radius) {
-    int offsetx, offsety, d;
-    int status;
-
-    offsetx = 0;
-    offsety = radius;
-    d = radius -1;
-    status = 0;
-    while (offsety >= offsetx) {
-        status += SDL_RenderLine(renderer, x - offsety, y + offsetx,
-                                     x + offsety, y + offsetx);
-        status += SDL_RenderLine(renderer, x - offsetx, y + offsety,
-                                 x + offsetx, y + offsety);
-        status += SDL_RenderLine(renderer, x - offsetx, y - offsety,
-                                 x + offsetx, y - offsety);
-        status += SDL_RenderLine(renderer, x - offsety, y - offsetx,
-                                     x + offsety, y - offsetx);
-        if (status < 0) {
-            status = -1;
-            break;
-        }
-        if (d >= 2*offsetx) {
-            d -= 2*offsetx + 1;
-            offsetx +=1;
-        }
-        else if (d < 2 * (radius - offsety)) {
-            d += 2 * offsety - 1;
-            offsety -= 1;
-        }
-        else {
-            d += 2 * (offsety - offsetx - 1);
-            offsety -= 1;
-            offsetx += 1;
+// Walk LOS_LANES cells toward the player's cell at once. Every lane steps a cell per
+// iteration, unused lanes start with no steps left.
+void trace_los_batch(const int *cells, int count) {
+    const int width = g_map.width;
+    const float target_x = g_los.player_cell % width, target_y = g_los.player_cell / width;
+    LosInt cell_x, cell_y, step_x, step_y, left;
+    LosFloat t_max_x, t_max_y, t_delta_x, t_delta_y;
+    for (int l = 0; l < LOS_LANES; l++) {
+        int cell = l < count ? cells[l] : g_los.player_cell;
+        cell_x[l] = cell % width;
+        cell_y[l] = cell / width;
+        float dx = target_x - cell_x[l], dy = target_y - cell_y[l];
+        step_x[l] = dx < 0 ? -1 : 1;
+        step_y[l] = dy < 0 ? -1 : 1;
+        left[l] = SDL_abs((int)dx) + SDL_abs((int)dy);
+        // from the middle of the cell half a cell to the first edge
+        t_delta_x[l] = dx != 0 ? 1.0f / SDL_fabsf(dx) : INFINITY;
+        t_delta_y[l] = dy != 0 ? 1.0f / SDL_fabsf(dy) : INFINITY;
+        t_max_x[l] = 0.5f * t_delta_x[l];
+        t_max_y[l] = 0.5f * t_delta_y[l];
+    }
+
+    LosInt blocked = {0};
+    const LosInt zero = {0};
+    while (true) {
+        LosInt active = (left > 0) & ~blocked;
+        bool any = false;
+        for (int l = 0; l < LOS_LANES; l++) any |= active[l] != 0;
+        if (!any) break;
+
+        LosInt along_x = t_max_x < t_max_y;
+        cell_x += LOS_SELECT(active & along_x, step_x, zero);
+        cell_y += LOS_SELECT(active & ~along_x, step_y, zero);
+        t_max_x = (LosFloat)LOS_SELECT(active & along_x, (LosInt)(t_max_x + t_delta_x), (LosInt)t_max_x);
+        t_max_y = (LosFloat)LOS_SELECT(active & ~along_x, (LosInt)(t_max_y + t_delta_y), (LosInt)t_max_y);
+        left += active; // -1 where active
+
+        // the player's own cell doesn't count
+        LosInt index = cell_y * width + cell_x;
+        for (int l = 0; l < LOS_LANES; l++) {
+            if (active[l] && left[l] > 0 && g_los.blocks[index[l]]) blocked[l] = -1;
         }
     }
-    return status;
+    for (int l = 0; l < count; l++) g_los.visible[cells[l]] = !blocked[l];
 }
 
-#define RAY_STEP 0.005f
-// Cast a ray from x_start, y_start facing angle
-RayData cast_ray(float x_start, float y_start, float angle) {
-    assert(x_start > 0 && x_start < g_map.width && y_start > 0 && y_start < g_map.height);
+// Whether each of count cells can see the player
+void line_of_sight(const int *cells, int count, uint8_t *out) {
+    const int size = g_map.width * g_map.height;
+    int player_cell = (int)player.y * g_map.width + (int)player.x;
+    bool resized = g_los.size != size;
+    if (resized) {
+        g_los.size = size;
+        g_los.blocks = realloc(g_los.blocks, size);
+        g_los.visible = realloc(g_los.visible, size);
+        g_los.epoch = realloc(g_los.epoch, size * sizeof(uint32_t));
+        g_los.pending = realloc(g_los.pending, size * sizeof(int));
+        memset(g_los.epoch, 0, size * sizeof(uint32_t));
+    }
+    // a moving door only changes the answers when it starts or stops blocking
+    if (sync_cell_flags(g_los.blocks, &g_los.revision, blocks_sight, resized)) g_los.current++;
+    if (g_los.player_cell != player_cell) {
+        g_los.player_cell = player_cell;
+        g_los.current++;
+    }
+    if (g_los.current == 0) g_los.current++; // epoch 0 is never answered
 
-    // don't cast too far
-    const float max_length = SDL_sqrtf(g_map.width*g_map.width + g_map.height*g_map.height);
-    const float x_step = RAY_STEP * SDL_cos(angle * DEG2RAD);
-    const float y_step = RAY_STEP * SDL_sin(angle * DEG2RAD);
-    const int max_steps = max_length / RAY_STEP;
-    for (int i = 0; i < max_steps; i++) {
-        float curr_x = player.x + i * x_step;
-        float curr_y = player.y + i * y_step;
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        if (g_los.epoch[cells[i]] == g_los.current) continue;
+        g_los.epoch[cells[i]] = g_los.current;
+        g_los.pending[pending++] = cells[i];
+    }
+    for (int i = 0; i < pending; i += LOS_LANES) trace_los_batch(g_los.pending + i, MIN(pending - i, LOS_LANES));
+    for (int i = 0; i < count; i++) out[i] = g_los.visible[cells[i]];
+}
+
+void free_line_of_sight() {
+    free(g_los.blocks);
+    free(g_los.visible);
+    free(g_los.epoch);
+    free(g_los.pending);
+    g_los = (LosCache){0};
+}
+
+#define ENEMY_SPEED 1.5f // cells per second
+
+// Breadth first search out from the player's cell, every cell is pointed at the one it
+// was reached from. Only redone when the player changes cell or a cell starts or stops
+// blocking movement, not for every frame a door moves.
+void update_flow_field() {
+    const int size = g_map.width * g_map.height;
+    int player_cell = (int)player.y * g_map.width + (int)player.x;
+    bool resized = g_map.flow_size != size;
+    if (resized) {
+        g_map.flow_size = size;
+        GROW_ARRAY(g_map.flow_next, size);
+        GROW_ARRAY(g_map.flow_blocked, size);
+        GROW_ARRAY(g_map.flow_queue, size);
+    }
+    bool blocking_changed = sync_cell_flags(g_map.flow_blocked, &g_map.flow_revision, blocks_movement, resized);
+    if (!blocking_changed && g_map.flow_cell == player_cell) return;
+    g_map.flow_cell = player_cell;
+
+    int *queue = g_map.flow_queue;
+    for (int i = 0; i < size; i++) g_map.flow_next[i] = -2;
+    g_map.flow_next[player_cell] = -1;
+    int head = 0, tail = 0;
+    queue[tail++] = player_cell;
+    while (head < tail) {
+        int cell = queue[head++];
+        int x = cell % g_map.width, y = cell / g_map.width;
+        const int offsets[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+        for (int d = 0; d < 4; d++) {
+            int nx = x + offsets[d][0], ny = y + offsets[d][1];
+            if (nx < 0 || ny < 0 || nx >= g_map.width || ny >= g_map.height) continue;
+            int next = ny * g_map.width + nx;
+            if (g_map.flow_next[next] != -2 || g_map.flow_blocked[next]) continue;
+            g_map.flow_next[next] = cell;
+            queue[tail++] = next;
+        }
+    }
+}
+
+// Takes out the dead and moves the rest toward the player. Hurt enemies recover on a timer.
+void update_enemies() {
+    Enemies *e = &g_map.enemies;
+    // backwards so the enemy moved into a freed place has been checked
+    for (int i = e->count - 1; i >= 0; i--) {
+        if (e->health[i] <= 0) despawn_enemy_at(i);
+    }
+
+    // enemies that see the player, or get shot, start chasing them
+    for (int i = 0; i < e->count; i++) e->cell[i] = (int)e->y[i] * g_map.width + (int)e->x[i];
+    line_of_sight(e->cell, e->count, e->sees_player);
+    for (int i = 0; i < e->count; i++) e->alert[i] |= e->sees_player[i] | (e->state[i] == ENEMY_HURT);
+
+    update_flow_field();
+    const float step = ENEMY_SPEED * e_state.delta_time;
+    for (int i = 0; i < e->count; i++) {
+        if (!e->alert[i] || e->state[i] == ENEMY_HURT) continue; // flinching
+        float to_player_x = player.x - e->x[i], to_player_y = player.y - e->y[i];
+        float reach = e->radius[i] + player.radius;
+        if (to_player_x * to_player_x + to_player_y * to_player_y <= reach * reach) continue;
+
+        // head for the middle of the next cell, the straight line there stays in the two open cells
+        int next = g_map.flow_next[e->cell[i]];
+        if (next == -2) continue;
+        float dx = to_player_x, dy = to_player_y;
+        if (next >= 0) {
+            dx = next % g_map.width + 0.5f - e->x[i];
+            dy = next / g_map.width + 0.5f - e->y[i];
+        }
+        float length = SDL_sqrtf(dx * dx + dy * dy);
+        if (length < 1e-4f) continue;
+        float move = MIN(step, length) / length;
+        e->x[i] += dx * move;
+        e->y[i] += dy * move;
+    }
+}
+
+// Filled circles are queued as triangle fans and drawn with one SDL_RenderGeometry call
+#define DISC_SEGMENTS 12
+typedef struct {
+    SDL_Vertex *vertices;
+    int *indices;
+    int disc_count;
+    int capacity; // in discs
+} DiscBatch;
+
+DiscBatch g_discs = {0};
+
+void disc_batch_add(DiscBatch *batch, float x, float y, float radius, Color color) {
+    static float unit[DISC_SEGMENTS][2];
+    if (unit[0][0] == 0.0f) {
+        for (int i = 0; i < DISC_SEGMENTS; i++) {
+            unit[i][0] = SDL_cosf(2.0f * SDL_PI_F * i / DISC_SEGMENTS);
+            unit[i][1] = SDL_sinf(2.0f * SDL_PI_F * i / DISC_SEGMENTS);
+        }
+    }
+    if (batch->disc_count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        batch->vertices = realloc(batch->vertices, batch->capacity * (DISC_SEGMENTS + 1) * sizeof(SDL_Vertex));
+        batch->indices = realloc(batch->indices, batch->capacity * DISC_SEGMENTS * 3 * sizeof(int));
+    }
+
+    SDL_FColor fcolor = {color.r / 255.0f, color.g / 255.0f, color.b / 255.0f, 1.0f};
+    int base = batch->disc_count * (DISC_SEGMENTS + 1);
+    SDL_Vertex *v = batch->vertices + base;
+    int *index = batch->indices + batch->disc_count * DISC_SEGMENTS * 3;
+    v[0] = (SDL_Vertex){{x, y}, fcolor, {0, 0}};
+    for (int i = 0; i < DISC_SEGMENTS; i++) {
+        v[i + 1] = (SDL_Vertex){{x + unit[i][0] * radius, y + unit[i][1] * radius}, fcolor, {0, 0}};
+        index[i*3 + 0] = base;
+        index[i*3 + 1] = base + 1 + i;
+        index[i*3 + 2] = base + 1 + (i + 1) % DISC_SEGMENTS;
+    }
+    batch->disc_count++;
+}
+
+void disc_batch_flush(SDL_Renderer *renderer, DiscBatch *batch) {
+    if (batch->disc_count == 0) return;
+    SDL_RenderGeometry(renderer, NULL, batch->vertices, batch->disc_count * (DISC_SEGMENTS + 1),
+                       batch->indices, batch->disc_count * DISC_SEGMENTS * 3);
+    batch->disc_count = 0;
+}
+
+// Mark a cell as seen for the automap
+void reveal_cell(int cell) {
+    uint32_t bit = 1u << (cell & 31);
+    if (g_map.seen[cell >> 5] & bit) return;
+    g_map.seen[cell >> 5] |= bit;
+    g_map.revealed[g_map.revealed_count++] = cell;
+}
+
+#define RAY_STEP 0.005f
+// Cast a ray from x_start, y_start facing angle
+RayData cast_ray(float x_start, float y_start, float angle) {
+    return cast_ray_dir(x_start, y_start, SDL_cos(angle * DEG2RAD), SDL_sin(angle * DEG2RAD));
+}
+
+// A wall that can't be seen or shot through at eye height
+bool blocks_eye_level(int cell) {
+    int wall_id = g_map.map[cell];
+    if (wall_id == 0 || (g_wall_flags[wall_id] & WALL_TRANSPARENT)) return false;
+    return g_map.floor_height[cell] <= 0.5f && g_map.ceiling_height[cell] >= 0.5f;
+}
+
+// A wall nothing behind it can be seen past
+bool hides_everything(int cell) {
+    int wall_id = g_map.map[cell];
+    if (wall_id == 0 || (g_wall_flags[wall_id] & WALL_TRANSPARENT) || door_plane(cell)) return false;
+    return g_map.floor_height[cell] <= 0.0f && g_map.ceiling_height[cell] >= g_map.max_height;
+}
+
+// The face of the wall cell a ray just stepped into at curr_x, curr_y coming from cell from
+RayData ray_face(float curr_x, float curr_y, float x_step, float y_step, int cell, int from) {
+    int dx = cell % g_map.width - from % g_map.width;
+    int dy = cell / g_map.width - from / g_map.width;
+    int wall_id = g_map.map[cell];
+    if (dx == 0) {
+        float y_end = y_step > 0 ? (int)curr_y : (int)curr_y + 1;
+        float x_end = curr_x;
+        return (RayData) {
+            .x = x_end,
+            .y = y_end,
+            .cell = cell,
+            .wall_id = wall_id,
+            .wall_orient = WALL_HORIZONTAL,
+        };
+    } else if (dy == 0) {
+        float x_end = x_step > 0 ? (int)curr_x : (int)curr_x + 1;
+        float y_end = curr_y;
+        return (RayData) {
+            .x = x_end,
+            .y = y_end,
+            .cell = cell,
+            .wall_id = wall_id,
+            .wall_orient = WALL_VERTICAL,
+        };
+    }
+    // went through a corner
+    float x_end = x_step > 0 ? (int)curr_x : (int)(curr_x + 1);
+    float y_end = y_step > 0 ? (int)curr_y : (int)(curr_y + 1);
+    return (RayData) {
+        .x = x_end,
+        .y = y_end,
+        .cell = cell,
+        .wall_id = wall_id,
+        .wall_orient = WALL_HORIZONTAL,
+    };
+}
+
+// Where a ray crosses a door's plane, false if it leaves the cell first or goes through the opening
+bool door_hit(const Door *door, float x_start, float y_start, float x_step, float y_step, RayData *hit) {
+    int cell_x = door->cell % g_map.width, cell_y = door->cell / g_map.width;
+    bool along_x = door->orient == WALL_HORIZONTAL;
+    float step = along_x ? y_step : x_step;
+    if (step == 0.0f) return false;
+    float plane = (along_x ? cell_y : cell_x) + door->offset;
+    float t = (plane - (along_x ? y_start : x_start)) / step;
+    if (t < 0.0f) return false;
+    float u = along_x ? x_start + t * x_step - cell_x : y_start + t * y_step - cell_y;
+    if (u < 0.0f || u >= 1.0f) return false;
+    if (door->kind == DOOR_SLIDING && u < door->open) return false;
+    *hit = (RayData){
+        .x = along_x ? cell_x + u : plane,
+        .y = along_x ? plane : cell_y + u,
+        .cell = door->cell,
+        .wall_id = g_map.map[door->cell],
+        .wall_orient = door->orient,
+    };
+    return true;
+}
+
+// Walks a ray through the map, one wall cell at a time
+typedef struct {
+    float x_start;
+    float y_start;
+    float x_step;
+    float y_step;
+    int step;
+    int max_steps;
+    int last_cell;
+    bool reveal; // mark the cells it passes through as seen, for the view's rays
+} RayMarch;
+
+// the direction doesn't need to be normalized
+RayMarch ray_march(float x_start, float y_start, float dir_x, float dir_y) {
+    assert(x_start > 0 && x_start < g_map.width && y_start > 0 && y_start < g_map.height);
+
+    // don't cast too far
+    const float max_length = SDL_sqrtf(g_map.width*g_map.width + g_map.height*g_map.height);
+    const float dir_length = SDL_sqrtf(dir_x*dir_x + dir_y*dir_y);
+    return (RayMarch){
+        .x_start = x_start,
+        .y_start = y_start,
+        .x_step = RAY_STEP * dir_x / dir_length,
+        .y_step = RAY_STEP * dir_y / dir_length,
+        .max_steps = max_length / RAY_STEP,
+        .last_cell = (int)y_start*g_map.width + (int)x_start,
+    };
+}
+
+// Step to the next wall cell the ray goes into, false once it leaves the map
+bool ray_march_next(RayMarch *march, RayData *hit) {
+    for (; march->step < march->max_steps; march->step++) {
+        float curr_x = march->x_start + march->step * march->x_step;
+        float curr_y = march->y_start + march->step * march->y_step;
+        if (curr_x < 0 || curr_y < 0 || curr_x >= g_map.width || curr_y >= g_map.height) return false;
+
+        // nothing new until the ray gets to another cell
+        int cell = (int)curr_y*g_map.width + (int)curr_x;
+        if (cell == march->last_cell) continue;
+        if (march->reveal) reveal_cell(cell);
+        int from = march->last_cell;
+        march->last_cell = cell;
 
         // in a wall
-        int wall_id = g_map.map[(int)curr_y*g_map.width + (int)curr_x];
-        if (wall_id != 0) {
-            float eps = 1.1f;
-            bool horizontal = g_map.map[(int)(curr_y - y_step*eps)*g_map.width + (int)curr_x] == 0;
-            bool vertical = g_map.map[(int)curr_y*g_map.width + (int)(curr_x - x_step*eps)] == 0;
-            if (horizontal) {
-                float y_end = y_step > 0 ? (int)curr_y : (int)curr_y + 1;
-                float x_end = curr_x;
-                return (RayData) {
-                    .x = x_end,
-                    .y = y_end,
-                    .wall_id = wall_id,
-                    .wall_orient = WALL_HORIZONTAL,
-                };
-            } else if (vertical) {
-                float x_end = x_step > 0 ? (int)curr_x : (int)curr_x + 1;
-                float y_end = curr_y;
-                return (RayData) {
-                    .x = x_end,
-                    .y = y_end,
-                    .wall_id = wall_id,
-                    .wall_orient = WALL_VERTICAL,
-                };
-            }
-            // hit a corner
-            float x_end = x_step > 0 ? (int)curr_x : (int)(curr_x + 1);
-            float y_end = y_step > 0 ? (int)curr_y : (int)(curr_y + 1);
-            return (RayData) {
-                .x = x_end,
-                .y = y_end,
-                .wall_id = wall_id,
-                .wall_orient = WALL_HORIZONTAL,
-            };
+        if (g_map.map[cell] == 0) continue;
+        const Door *door = door_plane(cell);
+        if (door) {
+            if (!door_hit(door, march->x_start, march->y_start, march->x_step, march->y_step, hit)) continue;
+        } else {
+            *hit = ray_face(curr_x, curr_y, march->x_step, march->y_step, cell, from);
         }
+        march->step++;
+        return true;
+    }
+    return false;
+}
+
+// Cast a ray from x_start, y_start along (dir_x, dir_y) to the first wall blocking eye level,
+// the direction doesn't need to be normalized
+RayData cast_ray_dir(float x_start, float y_start, float dir_x, float dir_y) {
+    RayMarch march = ray_march(x_start, y_start, dir_x, dir_y);
+    RayData hit;
+    while (ray_march_next(&march, &hit)) {
+        if (blocks_eye_level(hit.cell)) return hit;
     }
     fprintf(stderr, "Ray did not collide?\n");
     return (RayData){0};
 }
 
-// 2d map view
-void draw_level_map(SDL_Renderer *renderer) {
-    // Clear Black
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-
-    // White grid
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-    for (int row = 0; row < g_map.height; row++) {
-        for (int col = 0; col < g_map.width; col++) {
-            SDL_FRect rect = {
-                .x = col * g_map.x_scale,
-                .y = row * g_map.y_scale,
-                .w = g_map.x_scale,
-                .h = g_map.y_scale,
-            };
-            if (g_map.map[row * g_map.width + col] != 0) {
-               SDL_SetRenderDrawColor(renderer, 0, 0, 155, 255);
-               SDL_RenderFillRect(renderer, &rect);
-               SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+//---Wall Pass---
+
+void update_camera() {
+    float angle = player.angle * DEG2RAD;
+    g_camera.x = player.x;
+    g_camera.y = player.y;
+    g_camera.dir_x = SDL_cos(angle);
+    g_camera.dir_y = SDL_sin(angle);
+    g_camera.plane_length = SDL_tan(player.fov * 0.5f * DEG2RAD);
+    // y points down on the map so the right of the view direction is (-dir_y, dir_x)
+    g_camera.plane_x = -g_camera.dir_y * g_camera.plane_length;
+    g_camera.plane_y = g_camera.dir_x * g_camera.plane_length;
+}
+
+// -1 at the left edge of the screen and 1 at the right edge
+float column_camera_x(int column, int ray_count) {
+    return 2.0f * (column + 0.5f) / ray_count - 1.0f;
+}
+
+// Fill in a column from where its ray hit a wall
+void set_column(Column *c, float hit_x, float hit_y, int cell, int wall_id, int wall_orient, float depth) {
+    float texture_u = wall_orient == WALL_HORIZONTAL ? hit_x - (int)hit_x : hit_y - (int)hit_y;
+    // doors move their texture with them
+    const Door *door = door_plane(cell);
+    if (door && door->kind == DOOR_SLIDING) texture_u = MAX(texture_u - door->open, 0.0f);
+    *c = (Column){
+        .hit_x = hit_x,
+        .hit_y = hit_y,
+        .cell = cell,
+        .wall_id = wall_id,
+        .wall_orient = wall_orient,
+        .texture_u = texture_u - (int)texture_u,
+        .depth = depth,
+        .bottom = g_map.floor_height[cell],
+        .top = g_map.ceiling_height[cell],
+    };
+}
+
+// Walk the column's ray through every wall that doesn't hide what is behind it until the
+// column is covered. The uncovered part of the column is tracked as a window of slopes
+// (height - 0.5) / depth, the eye is at height 0.5. Walls are cut down to what shows
+// through the window and the ones that don't show at all are skipped, the walls in front
+// of the last one go in its layers.
+void cast_column(int column, int ray_count) {
+    float camera_x = column_camera_x(column, ray_count);
+    float dir_x = g_camera.dir_x + g_camera.plane_x * camera_x;
+    float dir_y = g_camera.dir_y + g_camera.plane_y * camera_x;
+    Column *c = &g_columns[column];
+    Column *layers = g_column_layers[column];
+    int layer_count = 0;
+
+    // starts as the whole screen
+    float low = -0.5f / (WALL_SCALE * player.radius);
+    float high = -low;
+    RayMarch march = ray_march(g_camera.x, g_camera.y, dir_x, dir_y);
+    march.reveal = true;
+    RayData hit;
+    bool covered = false;
+    while (!covered && ray_march_next(&march, &hit)) {
+        // Take only direct component of a ray as the distance to wall
+        float depth = (hit.x - g_camera.x) * g_camera.dir_x + (hit.y - g_camera.y) * g_camera.dir_y;
+        float floor = g_map.floor_height[hit.cell], ceiling = g_map.ceiling_height[hit.cell];
+        float bottom = MAX((floor - 0.5f) / depth, low);
+        float top = MIN((ceiling - 0.5f) / depth, high);
+
+        if (!(g_wall_flags[hit.wall_id] & WALL_TRANSPARENT)) {
+            // anything further away is above the bottom of a wall standing on the floor
+            if (floor <= 0.0f || bottom <= low) low = MAX(low, top);
+            if (top >= high) high = MIN(high, bottom);
+            covered = hides_everything(hit.cell) || low >= high || low >= (g_map.max_height - 0.5f) / depth;
+        }
+        if (!covered && bottom >= top) continue;
+        covered = covered || layer_count == MAX_WALL_LAYERS;
+
+        Column *wall = covered ? c : &layers[layer_count++];
+        set_column(wall, hit.x, hit.y, hit.cell, hit.wall_id, hit.wall_orient, depth);
+        wall->bottom = MAX(0.5f + bottom * depth, floor);
+        wall->top = MIN(0.5f + top * depth, ceiling);
+    }
+    if (!covered) {
+        // left the map, the furthest wall that showed ends the column
+        if (layer_count > 0) *c = layers[--layer_count];
+        else *c = (Column){0};
+    }
+    c->layer_count = layer_count;
+}
+
+#define NEAR_PLANE 0.01f
+
+// depth of a map point and the (fractional) screen column it projects to
+float project_point(float x, float y, int ray_count, float *column) {
+    float rel_x = x - g_camera.x, rel_y = y - g_camera.y;
+    float depth = rel_x * g_camera.dir_x + rel_y * g_camera.dir_y;
+    float side = (rel_x * g_camera.plane_x + rel_y * g_camera.plane_y) / g_camera.plane_length;
+    float camera_x = side / (depth * g_camera.plane_length);
+    *column = (camera_x + 1.0f) * 0.5f * ray_count - 0.5f;
+    return depth;
+}
+
+// Project the wall face from (x0, y0) to (x1, y1) and write it into every column it covers
+// where it is closer than what is already there. u is perspective correct: u/depth and 1/depth
+// are linear across the screen.
+void project_wall_face(float x0, float y0, float x1, float y1, int cell, int wall_id, int wall_orient, int ray_count) {
+    float s0 = 0.0f, s1 = 1.0f; // position along the face
+    float depth0 = (x0 - g_camera.x) * g_camera.dir_x + (y0 - g_camera.y) * g_camera.dir_y;
+    float depth1 = (x1 - g_camera.x) * g_camera.dir_x + (y1 - g_camera.y) * g_camera.dir_y;
+    if (depth0 < NEAR_PLANE && depth1 < NEAR_PLANE) return;
+
+    // clip against the near plane
+    if (depth0 < NEAR_PLANE) s0 = (NEAR_PLANE - depth0) / (depth1 - depth0);
+    else if (depth1 < NEAR_PLANE) s1 = (NEAR_PLANE - depth0) / (depth1 - depth0);
+    float dx = x1 - x0, dy = y1 - y0;
+
+    float col0, col1;
+    float z0 = project_point(x0 + s0*dx, y0 + s0*dy, ray_count, &col0);
+    float z1 = project_point(x0 + s1*dx, y0 + s1*dy, ray_count, &col1);
+    if (col0 > col1) {
+        float tmp;
+        tmp = col0; col0 = col1; col1 = tmp;
+        tmp = z0; z0 = z1; z1 = tmp;
+        tmp = s0; s0 = s1; s1 = tmp;
+    }
+    int first = MAX((int)SDL_ceilf(col0), 0);
+    int last = MIN((int)SDL_floorf(col1), ray_count - 1);
+    if (first > last) return;
+
+    float inv_z0 = 1.0f / z0, inv_z1 = 1.0f / z1;
+    float span = MAX(col1 - col0, 1e-6f);
+    for (int i = first; i <= last; i++) {
+        float t = (i - col0) / span;
+        float inv_z = inv_z0 + t * (inv_z1 - inv_z0);
+        float depth = 1.0f / inv_z;
+        Column *c = &g_columns[i];
+        if (c->wall_id != 0 && c->depth <= depth) continue;
+
+        float s = (s0 * inv_z0 + t * (s1 * inv_z1 - s0 * inv_z0)) * depth;
+        set_column(c, x0 + s*dx, y0 + s*dy, cell, wall_id, wall_orient, depth);
+    }
+}
+
+// Screen columns covered by a map cell and the closest depth of its corners.
+// Returns false if the cell is completely behind the camera or between two column centers.
+bool project_cell(int cell_x, int cell_y, int ray_count, int *first, int *last, float *min_depth) {
+    float col_min = 1e30f, col_max = -1e30f, max_depth = -1e30f;
+    *min_depth = 1e30f;
+    for (int corner = 0; corner < 4; corner++) {
+        float col;
+        float depth = project_point(cell_x + (corner & 1), cell_y + (corner >> 1), ray_count, &col);
+        *min_depth = MIN(*min_depth, depth);
+        max_depth = MAX(max_depth, depth);
+        if (depth < NEAR_PLANE) continue;
+        col_min = MIN(col_min, col);
+        col_max = MAX(col_max, col);
+    }
+    if (max_depth < NEAR_PLANE) return false;
+    if (*min_depth < NEAR_PLANE) {
+        // the near plane cuts through the cell, don't bother working out which part is on screen
+        col_min = 0;
+        col_max = ray_count - 1;
+    }
+    *first = MAX((int)SDL_ceilf(col_min), 0);
+    *last = MIN((int)SDL_floorf(col_max), ray_count - 1);
+    return *first <= *last;
+}
+
+// A cell is hidden if every column it covers already has a wall in front of it
+bool cell_occluded(int first, int last, float min_depth) {
+    for (int i = first; i <= last; i++) {
+        if (g_columns[i].wall_id == 0 || g_columns[i].depth > min_depth) return false;
+    }
+    return true;
+}
+
+// Find the walls for every column by flood filling the open cells visible from the
+// player's cell. Every wall face bordering a visited cell is projected once and its
+// columns filled in, cells that are off screen or behind walls already found aren't expanded.
+// Columns no face was found for fall back to casting a ray.
+int cast_wall_spans(int ray_count) {
+    static int *visited = NULL;
+    static int *queue = NULL;
+    static int visit_stamp = 0;
+    static int map_size = 0;
+    if (map_size != g_map.width * g_map.height) {
+        map_size = g_map.width * g_map.height;
+        visited = realloc(visited, map_size * sizeof(int));
+        queue = realloc(queue, map_size * sizeof(int));
+        memset(visited, 0, map_size * sizeof(int));
+        visit_stamp = 0;
+    }
+    visit_stamp++;
+
+    for (int i = 0; i < ray_count; i++) g_columns[i].wall_id = 0;
+
+    const int offsets[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+    int faces = 0;
+    int head = 0, tail = 0;
+    int start = (int)g_camera.y * g_map.width + (int)g_camera.x;
+    visited[start] = visit_stamp;
+    queue[tail++] = start;
+    reveal_cell(start);
+    while (head < tail) {
+        int cell = queue[head++];
+        int cell_x = cell % g_map.width, cell_y = cell / g_map.width;
+
+        for (int n = 0; n < 4; n++) {
+            int next_x = cell_x + offsets[n][0], next_y = cell_y + offsets[n][1];
+            if (next_x < 0 || next_x >= g_map.width || next_y < 0 || next_y >= g_map.height) continue;
+            int next = next_y * g_map.width + next_x;
+            int wall_id = g_map.map[next];
+
+            if (wall_id != 0) {
+                // the face on the shared edge, only if it faces the player
+                if (offsets[n][0] != 0) {
+                    float face_x = offsets[n][0] > 0 ? next_x : next_x + 1;
+                    if ((g_camera.x - face_x) * offsets[n][0] > 0) continue;
+                    project_wall_face(face_x, next_y, face_x, next_y + 1, next, wall_id, WALL_VERTICAL, ray_count);
+                } else {
+                    float face_y = offsets[n][1] > 0 ? next_y : next_y + 1;
+                    if ((g_camera.y - face_y) * offsets[n][1] > 0) continue;
+                    project_wall_face(next_x, face_y, next_x + 1, face_y, next, wall_id, WALL_HORIZONTAL, ray_count);
+                }
+                reveal_cell(next);
+                faces++;
+                continue;
+            }
+
+            if (visited[next] == visit_stamp) continue;
+            visited[next] = visit_stamp;
+            int first, last;
+            float min_depth;
+            if (!project_cell(next_x, next_y, ray_count, &first, &last, &min_depth)) continue;
+            if (cell_occluded(first, last, min_depth)) continue;
+            queue[tail++] = next;
+            reveal_cell(next);
+        }
+    }
+
+    // and columns that see a transparent, short or raised wall need to see what is behind it
+    for (int i = 0; i < ray_count; i++) {
+        if (g_columns[i].wall_id == 0 || !hides_everything(g_columns[i].cell)) {
+            cast_column(i, ray_count);
+            faces++;
+        }
+    }
+    return faces;
+}
+
+// Interlaced columns: past these the last frame is too different to rebuild from
+#define INTERLACE_MAX_TURN 3.0f // degrees per frame
+#define INTERLACE_MAX_MOVE 0.1f // map units per frame
+
+// The wall line a column hit and the cell edge along it, same face if all three match
+bool same_wall_face(const Column *a, const Column *b) {
+    if (a->wall_id == 0 || a->wall_id != b->wall_id || a->wall_orient != b->wall_orient) return false;
+    if (a->wall_orient == WALL_VERTICAL)
+        return SDL_roundf(a->hit_x) == SDL_roundf(b->hit_x) && SDL_floorf(a->hit_y) == SDL_floorf(b->hit_y);
+    return SDL_roundf(a->hit_y) == SDL_roundf(b->hit_y) && SDL_floorf(a->hit_x) == SDL_floorf(b->hit_x);
+}
+
+// Rebuild a column that wasn't cast this frame. The last frame's column looking in the same
+// direction tells us which wall face is there, the new ray is intersected with that face.
+// Only trusted if a neighbouring column cast this frame sees the same face, otherwise
+// we are at the edge of a wall and it could have moved out from behind something.
+bool reproject_column(int column, int ray_count) {
+    const Camera *prev = &g_interlace.camera;
+    float camera_x = column_camera_x(column, ray_count);
+    float dir_x = g_camera.dir_x + g_camera.plane_x * camera_x;
+    float dir_y = g_camera.dir_y + g_camera.plane_y * camera_x;
+
+    // which column looked this way last frame
+    float forward = dir_x * prev->dir_x + dir_y * prev->dir_y;
+    if (forward <= 0) return false;
+    float side = (dir_x * prev->plane_x + dir_y * prev->plane_y) / prev->plane_length;
+    int prev_column = (int)SDL_roundf((side / (forward * prev->plane_length) + 1.0f) * 0.5f * ray_count - 0.5f);
+    if (prev_column < 0 || prev_column >= ray_count) return false;
+    const Column *old = &g_interlace.columns[prev_column];
+    if (old->wall_id == 0 || old->layer_count > 0 || !hides_everything(old->cell)) return false;
+
+    // distance along the ray to the wall line, the ray's forward component is 1 so this is also the depth
+    float depth;
+    if (old->wall_orient == WALL_VERTICAL) {
+        if (SDL_fabsf(dir_x) < 1e-6f) return false;
+        depth = (SDL_roundf(old->hit_x) - g_camera.x) / dir_x;
+    } else {
+        if (SDL_fabsf(dir_y) < 1e-6f) return false;
+        depth = (SDL_roundf(old->hit_y) - g_camera.y) / dir_y;
+    }
+    if (depth < NEAR_PLANE) return false;
+
+    Column rebuilt;
+    set_column(&rebuilt, g_camera.x + depth * dir_x, g_camera.y + depth * dir_y, old->cell, old->wall_id, old->wall_orient, depth);
+    if (!same_wall_face(&rebuilt, old)) return false;
+    bool left = column > 0 && same_wall_face(&rebuilt, &g_columns[column - 1]);
+    bool right = column + 1 < ray_count && same_wall_face(&rebuilt, &g_columns[column + 1]);
+    if (!left && !right) return false;
+
+    g_columns[column] = rebuilt;
+    return true;
+}
+
+// Cast every other column and rebuild the rest from last frame, unless the camera moved
+// or turned too far since then or the resolution changed
+void cast_columns_interlaced(int ray_count) {
+    const Camera *prev = &g_interlace.camera;
+    float turn = g_camera.dir_x * prev->dir_x + g_camera.dir_y * prev->dir_y;
+    float move = DISTANCE(g_camera.x, g_camera.y, prev->x, prev->y);
+    bool full_refresh = !g_interlace.valid || g_interlace.ray_count != ray_count ||
+                        turn < SDL_cos(INTERLACE_MAX_TURN * DEG2RAD) || move > INTERLACE_MAX_MOVE;
+
+    if (full_refresh) {
+        for (int i = 0; i < ray_count; i++) cast_column(i, ray_count);
+    } else {
+        const int parity = g_interlace.parity;
+        for (int i = parity; i < ray_count; i += 2) cast_column(i, ray_count);
+        for (int i = 1 - parity; i < ray_count; i += 2) {
+            if (!reproject_column(i, ray_count)) cast_column(i, ray_count);
+        }
+    }
+
+    g_interlace.camera = g_camera;
+    memcpy(g_interlace.columns, g_columns, ray_count * sizeof(Column));
+    g_interlace.ray_count = ray_count;
+    g_interlace.valid = true;
+    g_interlace.parity = 1 - g_interlace.parity;
+}
+
+// Fill g_columns with the wall hit for every column on the screen
+void cast_columns(int ray_count) {
+    update_camera();
+    if (e_state.wall_spans) {
+        cast_wall_spans(ray_count);
+        g_interlace.valid = false;
+        return;
+    }
+    if (e_state.interlaced) {
+        cast_columns_interlaced(ray_count);
+        return;
+    }
+    for (int i = 0; i < ray_count; i++) cast_column(i, ray_count);
+    g_interlace.valid = false;
+}
+
+// Fill g_z_pyramid from g_z_buffer, each level from the one below it
+void build_z_pyramid(int ray_count) {
+    g_z_pyramid.ray_count = ray_count;
+    for (int level = 0; level < Z_LEVELS; level++) {
+        const int tiles = ((ray_count - 1) >> Z_TILE_SHIFT(level)) + 1;
+        for (int t = 0; t < tiles; t++) {
+            float min = INFINITY, max = 0.0f;
+            if (level == 0) {
+                for (int i = t << Z_TILE_SHIFT(0); i < MIN((t + 1) << Z_TILE_SHIFT(0), ray_count); i++) {
+                    min = MIN(min, g_z_buffer[i]);
+                    max = MAX(max, g_z_buffer[i]);
+                }
             } else {
-               SDL_RenderRect(renderer, &rect);
+                // 4 tiles of the level below
+                const int below = ((ray_count - 1) >> Z_TILE_SHIFT(level - 1)) + 1;
+                for (int b = t * 4; b < MIN(t * 4 + 4, below); b++) {
+                    min = MIN(min, g_z_pyramid.min[level - 1][b]);
+                    max = MAX(max, g_z_pyramid.max[level - 1][b]);
+                }
             }
+            g_z_pyramid.min[level][t] = min;
+            g_z_pyramid.max[level][t] = max;
+        }
+    }
+}
+
+// Nearest and furthest wall over columns first to last. Walks the range with the biggest
+// tiles that fit, so only the ends of the range touch single columns.
+void z_range(int first, int last, float *min, float *max) {
+    *min = INFINITY;
+    *max = 0.0f;
+    first = MAX(first, 0);
+    last = MIN(last, g_z_pyramid.ray_count - 1);
+    for (int i = first; i <= last;) {
+        int level = Z_LEVELS - 1;
+        while (level >= 0 && ((i & ((1 << Z_TILE_SHIFT(level)) - 1)) != 0 ||
+                              i + (1 << Z_TILE_SHIFT(level)) - 1 > last)) level--;
+        if (level < 0) {
+            *min = MIN(*min, g_z_buffer[i]);
+            *max = MAX(*max, g_z_buffer[i]);
+            i++;
+            continue;
+        }
+        int tile = i >> Z_TILE_SHIFT(level);
+        *min = MIN(*min, g_z_pyramid.min[level][tile]);
+        *max = MAX(*max, g_z_pyramid.max[level][tile]);
+        i += 1 << Z_TILE_SHIFT(level);
+    }
+}
+
+// 2d map view
+// The cells changed since revision from the journal, false if it doesn't go back that far.
+// cells needs room for MAP_JOURNAL_SIZE.
+bool map_changes_since(int revision, int *cells, int *count) {
+    *count = 0;
+    if (g_map.revision - revision > MAP_JOURNAL_SIZE) return false;
+    for (int r = revision; r < g_map.revision; r++) cells[(*count)++] = g_map.journal[r % MAP_JOURNAL_SIZE];
+    return true;
+}
+
+// What a map view drawn at revision and door_version has to redraw: the cells in the journal and
+// the cells of doors that moved, a push wall covers the cell it is moving into as well. False if
+// the journal doesn't go back that far. cells needs room for MAP_REDRAW_SIZE.
+#define MAP_REDRAW_SIZE (MAP_JOURNAL_SIZE + 2 * g_map.door_count)
+bool map_redraws_since(int revision, int door_version, int *cells, int *count) {
+    if (!map_changes_since(revision, cells, count)) return false;
+    if (door_version == g_map.door_version) return true;
+    for (int i = 0; i < g_map.door_count; i++) {
+        const Door *door = &g_map.doors[i];
+        if (door->moved <= door_version) continue;
+        cells[(*count)++] = door->cell;
+        int next = door->kind == DOOR_PUSH_WALL ? push_wall_next(door) : -1;
+        if (next >= 0) cells[(*count)++] = next;
+    }
+    return true;
+}
+
+// A door's plane seen from above, the part that hasn't slid open. Push walls are drawn as the
+// whole wall part of the way into the next cell.
+SDL_FRect door_map_rect(const Door *door, float cell_w, float cell_h) {
+    float x = door->cell % g_map.width, y = door->cell / g_map.width;
+    const float thickness = 0.2f;
+    if (door->kind == DOOR_PUSH_WALL) {
+        float shift = door->open * door->direction;
+        if (door->orient == WALL_VERTICAL) x += shift;
+        else y += shift;
+        return (SDL_FRect){x * cell_w, y * cell_h, cell_w, cell_h};
+    }
+    if (door->orient == WALL_HORIZONTAL) {
+        return (SDL_FRect){(x + door->open) * cell_w, (y + door->offset - thickness / 2) * cell_h,
+                           (1.0f - door->open) * cell_w, thickness * cell_h};
+    }
+    return (SDL_FRect){(x + door->offset - thickness / 2) * cell_w, (y + door->open) * cell_h,
+                       thickness * cell_w, (1.0f - door->open) * cell_h};
+}
+
+// Draw cells of the layout into the current render target. Walls are filled, open cells are
+// filled with open_color and outlined if grid is set, doors go over both in a last batch.
+void draw_map_cells(SDL_Renderer *renderer, const int *cells, int count, float cell_w, float cell_h,
+                    Color open_color, bool grid) {
+    SDL_FRect *walls = malloc(count * sizeof(SDL_FRect));
+    SDL_FRect *open = malloc(count * sizeof(SDL_FRect));
+    SDL_FRect *doors = malloc(count * sizeof(SDL_FRect));
+    int wall_count = 0, open_count = 0, door_count = 0;
+    for (int i = 0; i < count; i++) {
+        int cell = cells[i];
+        SDL_FRect rect = {
+            .x = (cell % g_map.width) * cell_w,
+            .y = (cell / g_map.width) * cell_h,
+            .w = cell_w,
+            .h = cell_h,
+        };
+        const Door *door = door_plane(cell);
+        if (door) doors[door_count++] = door_map_rect(door, cell_w, cell_h);
+        if (g_map.map[cell] != 0 && !door) walls[wall_count++] = rect;
+        else open[open_count++] = rect;
+    }
+    SDL_SetRenderDrawColor(renderer, 0, 0, 155, 255);
+    SDL_RenderFillRects(renderer, walls, wall_count);
+    SDL_SetRenderDrawColor(renderer, open_color.r, open_color.g, open_color.b, 255);
+    SDL_RenderFillRects(renderer, open, open_count);
+    if (grid) {
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        SDL_RenderRects(renderer, open, open_count);
+    }
+    SDL_SetRenderDrawColor(renderer, 140, 90, 50, 255);
+    SDL_RenderFillRects(renderer, doors, door_count);
+    free(walls);
+    free(open);
+    free(doors);
+}
+
+// Draw the static part of the map into g_map.grid, only the cells in the journal and the doors that
+// moved if it was drawn before
+void update_map_grid(SDL_Renderer *renderer) {
+    if (g_map.grid && g_map.grid_revision == g_map.revision && g_map.grid_door_version == g_map.door_version) return;
+    SDL_Texture *target = SDL_GetRenderTarget(renderer);
+    int changed[MAP_REDRAW_SIZE], changed_count;
+    if (g_map.grid && map_redraws_since(g_map.grid_revision, g_map.grid_door_version, changed, &changed_count)) {
+        SDL_SetRenderTarget(renderer, g_map.grid);
+        draw_map_cells(renderer, changed, changed_count, g_map.x_scale, g_map.y_scale, (Color){0, 0, 0}, true);
+    } else {
+        if (!g_map.grid) {
+            g_map.grid = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                           SDL_TEXTUREACCESS_TARGET, g_render.width, g_render.height);
         }
+        SDL_SetRenderTarget(renderer, g_map.grid);
+        int count = g_map.width * g_map.height;
+        int *cells = malloc(count * sizeof(int));
+        for (int i = 0; i < count; i++) cells[i] = i;
+        draw_map_cells(renderer, cells, count, g_map.x_scale, g_map.y_scale, (Color){0, 0, 0}, true);
+        free(cells);
     }
+    SDL_SetRenderTarget(renderer, target);
+    g_map.grid_revision = g_map.revision;
+    g_map.grid_door_version = g_map.door_version;
+}
 
-    // Player
-    SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-    render_fill_circle(renderer, g_map.x_scale * player.x, g_map.y_scale * player.y, g_map.x_scale * player.radius);
+#define AUTOMAP_CELL 16
+// Draw the cells revealed since the last call into g_map.automap, and the seen cells that changed
+// or have a door that moved. Everything is redrawn if the journal doesn't go back far enough.
+void update_automap(SDL_Renderer *renderer) {
+    int changed[MAP_REDRAW_SIZE], changed_count = 0;
+    bool rebuild = !g_map.automap ||
+                   !map_redraws_since(g_map.automap_revision, g_map.automap_door_version, changed, &changed_count);
+    if (!rebuild && changed_count == 0 && g_map.automap_count == g_map.revealed_count) return;
+
+    SDL_Texture *target = SDL_GetRenderTarget(renderer);
+    if (!g_map.automap) {
+        g_map.automap = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                          g_map.width * AUTOMAP_CELL, g_map.height * AUTOMAP_CELL);
+        SDL_SetTextureBlendMode(g_map.automap, SDL_BLENDMODE_BLEND);
+    }
+    SDL_SetRenderTarget(renderer, g_map.automap);
+    const Color open_color = {40, 40, 40};
+    if (rebuild) {
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        g_map.automap_count = 0;
+    } else {
+        // changed cells that were already on the map
+        int seen_count = 0;
+        for (int i = 0; i < changed_count; i++) {
+            int cell = changed[i];
+            if (g_map.seen[cell >> 5] & (1u << (cell & 31))) changed[seen_count++] = cell;
+        }
+        draw_map_cells(renderer, changed, seen_count, AUTOMAP_CELL, AUTOMAP_CELL, open_color, false);
+    }
+    draw_map_cells(renderer, g_map.revealed + g_map.automap_count, g_map.revealed_count - g_map.automap_count,
+                   AUTOMAP_CELL, AUTOMAP_CELL, open_color, false);
+
+    SDL_SetRenderTarget(renderer, target);
+    g_map.automap_count = g_map.revealed_count;
+    g_map.automap_revision = g_map.revision;
+    g_map.automap_door_version = g_map.door_version;
+}
+
+// Corner of the 3d view the automap is shown in
+SDL_FRect minimap_rect() {
+    float h = g_render.height / 4.0f;
+    float w = h * g_map.width / g_map.height;
+    float margin = g_render.height / 50.0f;
+    return (SDL_FRect){g_render.width - w - margin, margin, w, h};
+}
+
+void draw_minimap(SDL_Renderer *renderer) {
+    update_automap(renderer);
+    SDL_FRect rect = minimap_rect();
+    SDL_RenderTexture(renderer, g_map.automap, NULL, &rect);
+
+    float cell_w = rect.w / g_map.width, cell_h = rect.h / g_map.height;
+    disc_batch_add(&g_discs, rect.x + player.x * cell_w, rect.y + player.y * cell_h,
+                   MAX(player.radius * cell_w, 2.0f), (Color){255, 0, 0});
+    disc_batch_flush(renderer, &g_discs);
+}
+
+// Uses the rays from the wall pass in g_columns, these have to be cast first
+void draw_level_map(SDL_Renderer *renderer) {
+    if (e_state.reveal_map) {
+        update_map_grid(renderer);
+        SDL_RenderTexture(renderer, g_map.grid, NULL, NULL);
+    } else {
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        update_automap(renderer);
+        SDL_RenderTexture(renderer, g_map.automap, NULL, NULL);
+    }
 
     // Rays
-    float ray_step = player.fov / RAY_COUNT;
-    float angle_start = player.angle - player.fov / 2.0f;
-    float angle_end = player.angle + player.fov / 2.0f;
-    for (float angle = angle_start; angle <= angle_end; angle += ray_step) {
-        RayData ray_data = cast_ray(player.x, player.y, angle);
-        if (ray_data.wall_orient == WALL_VERTICAL) SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+    for (int i = 0; i < g_render.ray_count; i++) {
+        const Column *column = &g_columns[i];
+        if (column->wall_orient == WALL_VERTICAL) SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
         else SDL_SetRenderDrawColor(renderer, 255, 127, 80, 255);
         SDL_RenderLine(renderer, g_map.x_scale * player.x, g_map.y_scale * player.y,
-                       g_map.x_scale * ray_data.x, g_map.y_scale * ray_data.y);
+                       g_map.x_scale * column->hit_x, g_map.y_scale * column->hit_y);
     }
 
-    // sprite
-    SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
-    for (int i = 0; i < g_map.object_count; i++)
-        render_fill_circle(renderer, g_map.x_scale * g_map.objects[i].x, g_map.y_scale * g_map.objects[i].y, g_map.x_scale * 0.05f);
+    // sprites and player, in one batch
+    const Objects *objects = &g_map.objects;
+    for (int i = 0; i < objects->count; i++) {
+        int cell = (int)objects->y[i] * g_map.width + (int)objects->x[i];
+        if (!e_state.reveal_map && !(g_map.seen[cell >> 5] & (1u << (cell & 31)))) continue;
+        disc_batch_add(&g_discs, g_map.x_scale * objects->x[i], g_map.y_scale * objects->y[i],
+                       g_map.x_scale * 0.05f, (Color){0, 255, 0});
+    }
+    disc_batch_add(&g_discs, g_map.x_scale * player.x, g_map.y_scale * player.y,
+                   g_map.x_scale * player.radius, (Color){255, 0, 0});
+    disc_batch_flush(renderer, &g_discs);
 
 }
 
+// furthest first
 int sprite_compare(const void *lhs, const void *rhs) {
-    Sprite *s_left = (Sprite *)lhs;
-    Sprite *s_right = (Sprite *)rhs;
+    const ProjectedSprite *s_left = lhs;
+    const ProjectedSprite *s_right = rhs;
 
-    float dist_left = DISTANCE(player.x, player.y, s_left->x, s_left->y);
-    float dist_right = DISTANCE(player.x, player.y, s_right->x, s_right->y);
-
-    if (dist_left < dist_right) return 1;
-    else if (dist_left > dist_right) return -1;
+    if (s_left->depth < s_right->depth) return 1;
+    else if (s_left->depth > s_right->depth) return -1;
     else return 0;
 }
 
-void draw_sprite(SDL_Renderer *r, Sprite s, float *z_buffer, float ray_delta) {
-    float dir_x = s.x - player.x, dir_y = s.y - player.y;
-    float distance = DISTANCE(player.x, player.y, s.x, s.y);
+//---Lighting---
+
+const uint8_t *palette_colormap(int r_level, int g_level, int b_level);
+
+void init_shade_tables() {
+    for (int level = 0; level < SHADE_LEVELS; level++) {
+        for (int c = 0; c < 256; c++) g_colormaps[level][c] = c * level / (SHADE_LEVELS - 1);
+    }
+    for (int light = 0; light < LIGHT_LEVELS; light++) {
+        for (int band = 0; band < DISTANCE_BANDS; band++) {
+            float brightness = (light + 1.0f) / LIGHT_LEVELS;
+            float fog = 1.0f - FOG_STRENGTH * band / (DISTANCE_BANDS - 1);
+            g_shade_levels[light][band] = SDL_roundf(brightness * fog * (SHADE_LEVELS - 1));
+        }
+    }
+}
 
-    // This is some absolute diabolical stuff
-    float sprite_angle = NORM_ANGLE(SDL_atan2(dir_y, dir_x) * RAD2DEG);
-    float theta =  player.angle - sprite_angle;
-    if (360 - theta < theta) theta = theta - 360;
-    else if (SDL_abs(theta + 360) < SDL_abs(theta)) theta += 360;
+int distance_band(float depth) {
+    return MIN((int)(depth * (DISTANCE_BANDS / FOG_DISTANCE)), DISTANCE_BANDS - 1);
+}
+
+// Colormaps for something at depth in a given light level, tint scales each channel
+Shade get_shade(int light, float depth, Color tint) {
+    int level = g_shade_levels[MAX(MIN(light, LIGHT_LEVELS - 1), 0)][distance_band(depth)];
+    int r = level * tint.r / 255, g = level * tint.g / 255, b = level * tint.b / 255;
+    return (Shade){g_colormaps[r], g_colormaps[g], g_colormaps[b], palette_colormap(r, g, b)};
+}
+
+// Light level of the cell at x, y, the ambient light outside the map
+int light_at(int x, int y) {
+    if (x < 0 || x >= g_map.width || y < 0 || y >= g_map.height) return g_map.light;
+    return g_map.light_grid[y * g_map.width + x];
+}
+
+// Record a change to the layout. Things built from the layout read the journal to update only what changed.
+void map_set_cell(int x, int y, int wall_id) {
+    int cell = y * g_map.width + x;
+    g_map.map[cell] = wall_id;
+    g_map.journal[g_map.revision % MAP_JOURNAL_SIZE] = cell;
+    g_map.revision++;
+}
+
+// Light spreads from the light's cell through open cells losing LIGHT_FALLOFF per step
+#define LIGHT_FALLOFF 2
+
+void refresh_light_cell(int cell) {
+    g_map.light_grid[cell] = MIN(g_map.light + g_map.light_sum[cell], LIGHT_LEVELS - 1);
+}
+
+void unspread_light(LightSpread *light) {
+    for (int i = 0; i < light->count; i++) {
+        int cell = light->cells[i*2];
+        g_map.light_sum[cell] -= light->cells[i*2 + 1];
+        refresh_light_cell(cell);
+    }
+    light->count = 0;
+}
 
-    if (SDL_abs(theta) > player.fov)
+// Bounded BFS from the light's cell, only reaches cells within level / LIGHT_FALLOFF steps
+void spread_light(LightSpread *light) {
+    int *steps = g_map.light_steps;
+    int *queue = g_map.light_queue;
+
+    const Objects *objects = &g_map.objects;
+    light->level = objects->light[light->object];
+    light->cell = (int)objects->y[light->object] * g_map.width + (int)objects->x[light->object];
+    light->count = 0;
+    if (light->level <= 0 || g_map.map[light->cell] != 0) return;
+
+    const int offsets[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+    int head = 0, tail = 0;
+    queue[tail++] = light->cell;
+    steps[light->cell] = 1;
+    while (head < tail) {
+        int cell = queue[head++];
+        int amount = light->level - (steps[cell] - 1) * LIGHT_FALLOFF;
+
+        if (light->count == light->capacity) {
+            light->capacity = light->capacity ? light->capacity * 2 : 32;
+            light->cells = realloc(light->cells, light->capacity * 2 * sizeof(int));
+        }
+        light->cells[light->count*2] = cell;
+        light->cells[light->count*2 + 1] = amount;
+        light->count++;
+        g_map.light_sum[cell] += amount;
+        refresh_light_cell(cell);
+
+        if (amount - LIGHT_FALLOFF <= 0) continue;
+        int cell_x = cell % g_map.width, cell_y = cell / g_map.width;
+        for (int n = 0; n < 4; n++) {
+            int next_x = cell_x + offsets[n][0], next_y = cell_y + offsets[n][1];
+            if (next_x < 0 || next_x >= g_map.width || next_y < 0 || next_y >= g_map.height) continue;
+            int next = next_y * g_map.width + next_x;
+            if (steps[next] || g_map.map[next] != 0) continue;
+            steps[next] = steps[cell] + 1;
+            queue[tail++] = next;
+        }
+    }
+    // leave steps clear for the next spread
+    for (int i = 0; i < tail; i++) steps[queue[i]] = 0;
+}
+
+// Could a wall change at cell change where this light reaches
+bool light_near_cell(const LightSpread *light, int cell) {
+    int reach = light->level / LIGHT_FALLOFF + 1;
+    int dx = cell % g_map.width - light->cell % g_map.width;
+    int dy = cell / g_map.width - light->cell / g_map.width;
+    return SDL_abs(dx) <= reach && SDL_abs(dy) <= reach;
+}
+
+// Respread the lights that moved, changed or are near a changed wall. Called once a frame.
+void update_lighting() {
+    bool changed = false;
+    if (!g_map.lights) {
+        g_map.lights = calloc(g_map.objects.count, sizeof(LightSpread));
+        for (int i = 0; i < g_map.objects.count; i++) {
+            if (g_map.objects.light[i] <= 0) continue;
+            LightSpread *light = &g_map.lights[g_map.light_count++];
+            light->object = i;
+            spread_light(light);
+        }
+        for (int i = 0; i < g_map.width * g_map.height; i++) refresh_light_cell(i);
+        g_map.light_revision = g_map.revision;
+        g_map.lighting_version++;
         return;
+    }
+
+    bool journal_lost = g_map.revision - g_map.light_revision > MAP_JOURNAL_SIZE;
+    for (int i = 0; i < g_map.light_count; i++) {
+        LightSpread *light = &g_map.lights[i];
+        int o = light->object;
+        bool dirty = journal_lost || g_map.objects.light[o] != light->level ||
+                     (int)g_map.objects.y[o] * g_map.width + (int)g_map.objects.x[o] != light->cell;
+        for (int r = g_map.light_revision; !dirty && r < g_map.revision; r++)
+            dirty = light_near_cell(light, g_map.journal[r % MAP_JOURNAL_SIZE]);
+        if (!dirty) continue;
+
+        unspread_light(light);
+        spread_light(light);
+        changed = true;
+    }
+    if (g_map.light_revision != g_map.revision) {
+        // walls that were put down or taken away
+        for (int r = MAX(g_map.light_revision, g_map.revision - MAP_JOURNAL_SIZE); r < g_map.revision; r++)
+            refresh_light_cell(g_map.journal[r % MAP_JOURNAL_SIZE]);
+        g_map.light_revision = g_map.revision;
+        changed = true;
+    }
+    if (changed) g_map.lighting_version++;
+}
 
-    float depth = distance;
-    float w, h;
-    SDL_GetTextureSize(s.texture, &w, &h);
-    float sprite_height = RESY * (OBJECT_SCALE * player.radius / depth);
-    float sprite_width = sprite_height * (w / h);
+// Shade as an SDL color mod, for the gpu path
+void set_texture_shade(SDL_Texture *texture, Shade shade) {
+    SDL_SetTextureColorMod(texture, shade.r[255], shade.g[255], shade.b[255]);
+}
+
+//---Palette---
+
+// The indexed color renderer draws palette indices into an 8 bit framebuffer. The palette
+// is made from all map textures with median cut, and shading goes through colormaps that
+// map a palette index to the index of its shaded color.
+#define TRANSPARENT_INDEX 0
+#define COLOR_15(r, g, b) ((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3))
+
+uint32_t g_palette[256];
+int g_palette_size;
+uint8_t g_inverse_palette[1 << 15]; // closest palette index for a 15 bit color
+uint8_t *g_palette_colormaps[SHADE_LEVELS * SHADE_LEVELS * SHADE_LEVELS]; // built when first used
+const uint8_t *g_palette_grey[SHADE_LEVELS]; // untinted ones, always built so threads can use them
+
+typedef struct {
+    uint16_t color; // 15 bit
+    int count;
+} PaletteBin;
+
+typedef struct {
+    int start; // range of bins
+    int end;
+    int channel; // widest channel
+    int range;
+} ColorBox;
+
+int g_sort_channel;
+int bin_channel(const PaletteBin *bin, int channel) {
+    return (bin->color >> (10 - channel * 5)) & 31;
+}
+int bin_compare(const void *lhs, const void *rhs) {
+    return bin_channel(lhs, g_sort_channel) - bin_channel(rhs, g_sort_channel);
+}
+
+void color_box_measure(ColorBox *box, const PaletteBin *bins) {
+    box->range = -1;
+    for (int c = 0; c < 3; c++) {
+        int lo = 31, hi = 0;
+        for (int i = box->start; i < box->end; i++) {
+            lo = MIN(lo, bin_channel(&bins[i], c));
+            hi = MAX(hi, bin_channel(&bins[i], c));
+        }
+        if (hi - lo > box->range) {
+            box->range = hi - lo;
+            box->channel = c;
+        }
+    }
+}
+
+// Every distinct texture the map uses
+int collect_map_textures(Texture **out, int max) {
+    int count = 0;
+    #define ADD_TEXTURE(T) ({ Texture *_t = (T); bool _found = false;\
+        for (int _i = 0; _i < count; _i++) _found |= out[_i] == _t;\
+        if (_t && !_found && count < max) out[count++] = _t; })
+    for (int i = 0; i < MAX_TEXTURES; i++) ADD_TEXTURE(g_textures[i]);
+    for (int i = 0; i < g_map.objects.count; i++) {
+        if (g_map.objects.sprite_type[i] == OBJECT_STATIC) ADD_TEXTURE(g_map.objects.sprite[i].static_frame);
+    }
+    for (int i = 0; i < g_clip_count; i++) {
+        for (int j = 0; j < g_clips[i].frame_count; j++) ADD_TEXTURE(g_clips[i].frames[j]);
+    }
+    #undef ADD_TEXTURE
+    return count;
+}
+
+// Build the palette from the map textures and quantize them. Call after the map is loaded.
+void build_palette() {
+    Texture *textures[256];
+    int texture_count = collect_map_textures(textures, 256);
+
+    // histogram of 15 bit colors, from a small mip of each texture
+    int *histogram = calloc(1 << 15, sizeof(int));
+    for (int t = 0; t < texture_count; t++) {
+        const Texture *tex = textures[t];
+        int mip = 0;
+        while (mip + 1 < tex->mip_count && tex->mip_width[mip] > 128) mip++;
+        for (int x = 0; x < tex->mip_width[mip]; x++) {
+            for (int y = 0; y < tex->mip_height[mip]; y++) {
+                uint32_t c = tex->pixels[mip][(x << tex->mip_shift[mip]) + y];
+                if (COLOR_A(c) < 128) continue;
+                histogram[COLOR_15(COLOR_R(c), COLOR_G(c), COLOR_B(c))]++;
+            }
+        }
+    }
+    PaletteBin *bins = malloc((1 << 15) * sizeof(PaletteBin));
+    int bin_count = 0;
+    for (int i = 0; i < 1 << 15; i++) {
+        if (histogram[i]) bins[bin_count++] = (PaletteBin){i, histogram[i]};
+    }
+    free(histogram);
+
+    // median cut, split the box with the widest channel at the median until there are 255
+    ColorBox boxes[256];
+    int box_count = 0;
+    if (bin_count > 0) {
+        boxes[box_count] = (ColorBox){.start = 0, .end = bin_count};
+        color_box_measure(&boxes[box_count++], bins);
+    }
+    while (box_count < 255) {
+        int widest = -1;
+        for (int i = 0; i < box_count; i++) {
+            if (boxes[i].end - boxes[i].start < 2) continue;
+            if (widest < 0 || boxes[i].range > boxes[widest].range) widest = i;
+        }
+        if (widest < 0 || boxes[widest].range == 0) break;
+
+        ColorBox *box = &boxes[widest];
+        g_sort_channel = box->channel;
+        qsort(bins + box->start, box->end - box->start, sizeof(PaletteBin), bin_compare);
+        int total = 0, half = 0;
+        for (int i = box->start; i < box->end; i++) total += bins[i].count;
+        int split = box->start + 1;
+        for (int i = box->start; i < box->end - 1; i++) {
+            half += bins[i].count;
+            split = i + 1;
+            if (half * 2 >= total) break;
+        }
+        boxes[box_count] = (ColorBox){.start = split, .end = box->end};
+        box->end = split;
+        color_box_measure(box, bins);
+        color_box_measure(&boxes[box_count++], bins);
+    }
+
+    // index 0 is left for transparent texels, each box becomes its weighted average
+    g_palette[TRANSPARENT_INDEX] = PACK_COLOR(0, 0, 0, 0);
+    g_palette_size = box_count + 1;
+    for (int b = 0; b < box_count; b++) {
+        uint64_t sum[3] = {0}, count = 0;
+        for (int i = boxes[b].start; i < boxes[b].end; i++) {
+            for (int c = 0; c < 3; c++) sum[c] += (uint64_t)(bin_channel(&bins[i], c) * 255 / 31) * bins[i].count;
+            count += bins[i].count;
+        }
+        g_palette[b + 1] = PACK_COLOR(sum[0] / count, sum[1] / count, sum[2] / count, 0xFF);
+    }
+    free(bins);
+
+    // closest color for every 15 bit color
+    for (int i = 0; i < 1 << 15; i++) {
+        int r = ((i >> 10) & 31) * 255 / 31, g = ((i >> 5) & 31) * 255 / 31, b = (i & 31) * 255 / 31;
+        int best = 1, best_distance = INT32_MAX;
+        for (int p = 1; p < g_palette_size; p++) {
+            int dr = r - COLOR_R(g_palette[p]), dg = g - COLOR_G(g_palette[p]), db = b - COLOR_B(g_palette[p]);
+            int distance = dr*dr*3 + dg*dg*4 + db*db*2;
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = p;
+            }
+        }
+        g_inverse_palette[i] = best;
+    }
+
+    // quantize the textures
+    for (int t = 0; t < texture_count; t++) {
+        Texture *tex = textures[t];
+        for (int mip = 0; mip < tex->mip_count; mip++) {
+            int size = tex->mip_width[mip] << tex->mip_shift[mip];
+            free(tex->indexed[mip]);
+            tex->indexed[mip] = malloc(size);
+            for (int i = 0; i < size; i++) {
+                uint32_t c = tex->pixels[mip][i];
+                tex->indexed[mip][i] = COLOR_A(c) < 128 ? TRANSPARENT_INDEX :
+                    g_inverse_palette[COLOR_15(COLOR_R(c), COLOR_G(c), COLOR_B(c))];
+            }
+        }
+    }
+
+    // colormaps depend on the palette
+    for (int i = 0; i < SHADE_LEVELS * SHADE_LEVELS * SHADE_LEVELS; i++) {
+        free(g_palette_colormaps[i]);
+        g_palette_colormaps[i] = NULL;
+    }
+    for (int level = 0; level < SHADE_LEVELS; level++) g_palette_grey[level] = palette_colormap(level, level, level);
+}
+
+// Palette colormap for a shade level per channel, NULL before there is a palette
+const uint8_t *palette_colormap(int r_level, int g_level, int b_level) {
+    if (g_palette_size == 0) return NULL;
+    uint8_t **colormap = &g_palette_colormaps[(r_level * SHADE_LEVELS + g_level) * SHADE_LEVELS + b_level];
+    if (*colormap) return *colormap;
+
+    *colormap = malloc(256);
+    (*colormap)[TRANSPARENT_INDEX] = TRANSPARENT_INDEX;
+    for (int i = 1; i < 256; i++) {
+        uint32_t c = g_palette[i < g_palette_size ? i : 1];
+        (*colormap)[i] = g_inverse_palette[COLOR_15(g_colormaps[r_level][COLOR_R(c)],
+                                                    g_colormaps[g_level][COLOR_G(c)],
+                                                    g_colormaps[b_level][COLOR_B(c)])];
+    }
+    return *colormap;
+}
+
+void destroy_palette() {
+    for (int i = 0; i < SHADE_LEVELS * SHADE_LEVELS * SHADE_LEVELS; i++) free(g_palette_colormaps[i]);
+}
+
+//---Worker Threads---
+
+#define MAX_WORKERS 16
+#define ROWS_PER_BAND 8
+
+typedef void (*RowJob)(int y0, int y1, void *data);
+
+// Threads that split software rendering jobs by rows. The thread that runs a job helps too.
+typedef struct {
+    SDL_Thread *threads[MAX_WORKERS];
+    int count;
+    SDL_Semaphore *start;
+    SDL_Semaphore *done;
+    bool quit;
+
+    // current job
+    RowJob job;
+    void *data;
+    int rows;
+    SDL_AtomicInt next_band;
+} WorkerPool;
+
+WorkerPool g_workers = {0};
+
+// Take bands of rows from the current job until there are none left
+void work_rows() {
+    int band;
+    while ((band = SDL_AddAtomicInt(&g_workers.next_band, 1)) * ROWS_PER_BAND < g_workers.rows) {
+        int y0 = band * ROWS_PER_BAND;
+        g_workers.job(y0, MIN(y0 + ROWS_PER_BAND, g_workers.rows), g_workers.data);
+    }
+}
+
+int worker_main(void *data) {
+    (void)data;
+    while (true) {
+        SDL_WaitSemaphore(g_workers.start);
+        if (g_workers.quit) return 0;
+        work_rows();
+        SDL_SignalSemaphore(g_workers.done);
+    }
+}
+
+void init_workers(int count) {
+    g_workers.count = MAX(MIN(count, MAX_WORKERS), 0);
+    g_workers.start = SDL_CreateSemaphore(0);
+    g_workers.done = SDL_CreateSemaphore(0);
+    for (int i = 0; i < g_workers.count; i++)
+        g_workers.threads[i] = SDL_CreateThread(worker_main, "render worker", NULL);
+}
+
+void destroy_workers() {
+    g_workers.quit = true;
+    for (int i = 0; i < g_workers.count; i++) SDL_SignalSemaphore(g_workers.start);
+    for (int i = 0; i < g_workers.count; i++) SDL_WaitThread(g_workers.threads[i], NULL);
+    SDL_DestroySemaphore(g_workers.start);
+    SDL_DestroySemaphore(g_workers.done);
+    g_workers = (WorkerPool){0};
+}
+
+// Run job over rows [0, rows), returns once every row is done
+void run_rows(RowJob job, void *data, int rows) {
+    g_workers.job = job;
+    g_workers.data = data;
+    g_workers.rows = rows;
+    SDL_SetAtomicInt(&g_workers.next_band, 0);
+    for (int i = 0; i < g_workers.count; i++) SDL_SignalSemaphore(g_workers.start);
+    work_rows();
+    for (int i = 0; i < g_workers.count; i++) SDL_WaitSemaphore(g_workers.done);
+}
+
+//---Software Renderer---
+
+// Draw a strip of texture column tex_x of a mip level into the framebuffer between
+// columns x0 and x1. top and height are in screen pixels and may go past the edges of the screen,
+// only the rows from y_start to y_end are filled. The texture repeats past its bottom.
+void fb_draw_column(int x0, int x1, float top, float height, float y_start, float y_end,
+                    const Texture *texture, int mip, int tex_x, Shade shade, bool alpha_test) {
+    const SDL_Rect clip = g_framebuffer.clip;
+    x0 = MAX(x0, clip.x);
+    x1 = MIN(x1, clip.x + clip.w);
+    int y0 = MAX((int)SDL_ceilf(y_start), clip.y);
+    int y1 = MIN((int)SDL_ceilf(y_end), clip.y + clip.h);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    // 16.16 fixed point texture v
+    const int tex_h = texture->mip_height[mip];
+    const int shift = texture->mip_shift[mip];
+    const uint32_t v_mask = (1u << shift) - 1;
+    uint32_t v_step = (uint32_t)(tex_h * 65536.0f / height);
+    uint32_t v_start = (uint32_t)((y0 + 0.5f - top) * v_step);
+    tex_x = MIN(MAX(tex_x, 0), texture->mip_width[mip] - 1);
+
+    if (e_state.indexed_color) {
+        const uint8_t *column = texture->indexed[mip] + (tex_x << shift);
+        for (int x = x0; x < x1; x++) {
+            uint8_t *dst = g_framebuffer.indexed + y0*g_framebuffer.width + x;
+            uint32_t v = v_start;
+            for (int y = y0; y < y1; y++, dst += g_framebuffer.width, v += v_step) {
+                uint8_t c = column[(v >> 16) & v_mask];
+                if (alpha_test && c == TRANSPARENT_INDEX) continue;
+                *dst = shade.index[c];
+            }
+        }
+        return;
+    }
+
+    const uint32_t *column = texture->pixels[mip] + (tex_x << shift);
+    for (int x = x0; x < x1; x++) {
+        uint32_t *dst = g_framebuffer.pixels + y0*g_framebuffer.width + x;
+        uint32_t v = v_start;
+        for (int y = y0; y < y1; y++, dst += g_framebuffer.width, v += v_step) {
+            // rounding can step one texel past the end, that lands in the column padding
+            uint32_t c = column[(v >> 16) & v_mask];
+            if (alpha_test && COLOR_A(c) < 128) continue;
+            *dst = PACK_COLOR(shade.r[COLOR_R(c)], shade.g[COLOR_G(c)], shade.b[COLOR_B(c)], 0xFF);
+        }
+    }
+}
+
+typedef struct {
+    const Texture *sky;
+    const int *sky_u; // sky texel column offset for each screen column
+    const Texture *floor;
+} BackgroundJob;
+
+void fb_sky_row(int y, const BackgroundJob *job) {
+    const int width = g_framebuffer.width;
+    const int offset = y * job->sky->height / (g_framebuffer.height / 2);
+    if (e_state.indexed_color) {
+        const uint8_t *row = job->sky->indexed[0] + offset;
+        uint8_t *dst = g_framebuffer.indexed + y*width;
+        for (int x = 0; x < width; x++) dst[x] = row[job->sky_u[x]];
+        return;
+    }
+    const uint32_t *row = job->sky->pixels[0] + offset;
+    uint32_t *dst = g_framebuffer.pixels + y*width;
+    for (int x = 0; x < width; x++) dst[x] = row[job->sky_u[x]];
+}
+
+// How many more steps a 32.32 fixed point position can take before it leaves its cell
+int64_t pixels_in_cell(int64_t pos, int64_t step) {
+    int64_t frac = pos & 0xFFFFFFFF;
+    if (step > 0) return (0xFFFFFFFF - frac) / step;
+    if (step < 0) return frac / -step;
+    return INT32_MAX;
+}
+
+// Every pixel in a row below the horizon sees the floor at the same depth, so there is one
+// divide per row and the texture position just steps across it.
+void fb_floor_row(int y, const BackgroundJob *job) {
+    const int width = g_framebuffer.width, height = g_framebuffer.height;
+    const Texture *texture = job->floor;
+
+    // the floor is where the bottom of a wall at that depth would be
+    // (the first row can be on the horizon with odd heights)
+    float depth = (WALL_SCALE * player.radius * height / 2.0f) / MAX(y + 0.5f - height / 2.0f, 0.5f);
+    float step_x = depth * 2.0f * g_camera.plane_x / width;
+    float step_y = depth * 2.0f * g_camera.plane_y / width;
+    float floor_x = g_camera.x + depth * (g_camera.dir_x - g_camera.plane_x) + 0.5f * step_x;
+    float floor_y = g_camera.y + depth * (g_camera.dir_y - g_camera.plane_y) + 0.5f * step_y;
+
+    // a tile is this many pixels wide on this row
+    int mip = texture_mip_level(texture, width / (depth * 2.0f * g_camera.plane_length));
+    const uint32_t *texels = texture->pixels[mip];
+    const uint64_t tex_w = texture->mip_width[mip], tex_h = texture->mip_height[mip];
+    const int shift = texture->mip_shift[mip];
+
+    // 32.32 fixed point, the top half is the cell and the bottom half the position in it
+    int64_t pos_x = floor_x * 4294967296.0, pos_y = floor_y * 4294967296.0;
+    const int64_t step_x_fixed = step_x * 4294967296.0, step_y_fixed = step_y * 4294967296.0;
+
+    // and the position in the tile in texels, also 32.32. Steps are taken modulo a tile so
+    // they are less than one and it wraps with a compare.
+    const uint64_t tile_u = tex_w << 32, tile_v = tex_h << 32;
+    uint64_t tex_u = (uint32_t)pos_x * tex_w, tex_v = (uint32_t)pos_y * tex_h;
+    const uint64_t step_u = (uint32_t)step_x_fixed * tex_w, step_v = (uint32_t)step_y_fixed * tex_h;
+
+    // shade level for each light level at this row's depth. The light comes from the cell,
+    // which is only looked up again when the row crosses into the next one.
+    const int band = distance_band(depth);
+    uint8_t row_levels[LIGHT_LEVELS];
+    for (int l = 0; l < LIGHT_LEVELS; l++) row_levels[l] = g_shade_levels[l][band];
+    const uint8_t *light_grid = g_map.light_grid;
+    const int map_w = g_map.width, map_h = g_map.height;
+
+    if (e_state.indexed_color) {
+        const uint8_t *indexed = texture->indexed[mip];
+        uint8_t *dst = g_framebuffer.indexed + y*width;
+        int64_t cell_end = 0;
+        const uint8_t *colormap = NULL;
+        for (int x = 0; x < width; x++) {
+            if (x == cell_end) {
+                int cell_x = MAX(MIN((int)(pos_x >> 32), map_w - 1), 0);
+                int cell_y = MAX(MIN((int)(pos_y >> 32), map_h - 1), 0);
+                colormap = g_palette_grey[row_levels[light_grid[cell_y*map_w + cell_x]]];
+                cell_end = x + 1 + MIN(pixels_in_cell(pos_x, step_x_fixed), pixels_in_cell(pos_y, step_y_fixed));
+            }
+            dst[x] = colormap[indexed[((tex_u >> 32) << shift) + (tex_v >> 32)]];
+            pos_x += step_x_fixed;
+            pos_y += step_y_fixed;
+            tex_u += step_u;
+            tex_v += step_v;
+            if (tex_u >= tile_u) tex_u -= tile_u;
+            if (tex_v >= tile_v) tex_v -= tile_v;
+        }
+        return;
+    }
+    uint32_t *dst = g_framebuffer.pixels + y*width;
+    int64_t cell_end = 0; // where the row leaves the current cell
+    const uint8_t *colormap = NULL;
+    for (int x = 0; x < width; x++) {
+        if (x == cell_end) {
+            int cell_x = MAX(MIN((int)(pos_x >> 32), map_w - 1), 0);
+            int cell_y = MAX(MIN((int)(pos_y >> 32), map_h - 1), 0);
+            colormap = g_colormaps[row_levels[light_grid[cell_y*map_w + cell_x]]];
+            cell_end = x + 1 + MIN(pixels_in_cell(pos_x, step_x_fixed), pixels_in_cell(pos_y, step_y_fixed));
+        }
+        uint32_t c = texels[((tex_u >> 32) << shift) + (tex_v >> 32)];
+        dst[x] = PACK_COLOR(colormap[COLOR_R(c)], colormap[COLOR_G(c)], colormap[COLOR_B(c)], 0xFF);
+        pos_x += step_x_fixed;
+        pos_y += step_y_fixed;
+        tex_u += step_u;
+        tex_v += step_v;
+        if (tex_u >= tile_u) tex_u -= tile_u;
+        if (tex_v >= tile_v) tex_v -= tile_v;
+    }
+}
+
+void fb_background_rows(int y0, int y1, void *data) {
+    const BackgroundJob *job = data;
+    const int horizon = g_framebuffer.height / 2;
+    for (int y = y0; y < y1; y++) {
+        if (y < horizon) fb_sky_row(y, job);
+        else fb_floor_row(y, job);
+    }
+}
+
+// Sky over the top half of the screen repeating every sky_width pixels, textured floor below.
+// Needs the camera for this frame.
+void fb_draw_background(float sky_x, float sky_width) {
+    const Texture *sky = g_textures[TEXTURE_SKY];
+    const int width = g_framebuffer.width;
+    const int shift = sky->mip_shift[0];
+
+    int sky_u[width];
+    for (int x = 0; x < width; x++) {
+        float offset = SDL_fmodf(x - sky_x, sky_width);
+        if (offset < 0) offset += sky_width;
+        sky_u[x] = MIN((int)(offset / sky_width * sky->width), sky->width - 1) << shift;
+    }
+    BackgroundJob job = {sky, sky_u, g_textures[TEXTURE_FLOOR]};
+    run_rows(fb_background_rows, &job, g_framebuffer.height);
+}
+
+// Upload the part of the framebuffer inside rect and draw it to the render target
+void fb_present(SDL_Renderer *renderer, SDL_Rect rect) {
+    if (e_state.indexed_color) {
+        // expand to colors only now
+        for (int y = rect.y; y < rect.y + rect.h; y++) {
+            const uint8_t *src = g_framebuffer.indexed + y*g_framebuffer.width;
+            uint32_t *dst = g_framebuffer.pixels + y*g_framebuffer.width;
+            for (int x = rect.x; x < rect.x + rect.w; x++) dst[x] = g_palette[src[x]];
+        }
+    }
+    const uint32_t *pixels = g_framebuffer.pixels + rect.y*g_framebuffer.width + rect.x;
+    SDL_UpdateTexture(g_framebuffer.texture, &rect, pixels, g_framebuffer.width * sizeof(uint32_t));
+    SDL_FRect frect = {rect.x, rect.y, rect.w, rect.h};
+    SDL_RenderTexture(renderer, g_framebuffer.texture, &frect, &frect);
+}
+
+// Put back the wall pass under rect, sprites get drawn over it again
+void fb_restore_walls(SDL_Rect rect) {
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        int offset = y*g_framebuffer.width + rect.x;
+        if (e_state.indexed_color)
+            memcpy(g_framebuffer.indexed + offset, g_framebuffer.indexed_walls + offset, rect.w);
+        else
+            memcpy(g_framebuffer.pixels + offset, g_framebuffer.walls + offset, rect.w * sizeof(uint32_t));
+    }
+}
+
+// Work out where a sprite is on screen, returns false if it is behind the near plane
+bool project_sprite(Sprite s, float ray_delta, ProjectedSprite *out) {
+    // same camera as the walls, so depth is along the view direction like theirs
+    float column;
+    float depth = project_point(s.x, s.y, g_render.ray_count, &column);
+    if (depth < NEAR_PLANE) return false;
+
+    const int height = g_render.height;
+    float sprite_height = height * (OBJECT_SCALE * player.radius / depth);
+    float sprite_width = sprite_height * ((float)s.texture->width / s.texture->height);
 
     int ray_count = sprite_width / ray_delta;
-    int start_ray = (-theta + player.fov/2.0f) / player.fov * RAY_COUNT;
+    int start_ray = SDL_floorf(column + 0.5f - 0.5f * sprite_width / ray_delta); // start from left
+
+    *out = (ProjectedSprite){
+        .texture = s.texture,
+        .tint = s.tint,
+        .shade = get_shade(light_at((int)s.x, (int)s.y), depth, s.tint),
+        .depth = depth,
+        // far away sprites sample a smaller mip
+        .mip = texture_mip_level(s.texture, sprite_height),
+        .start_ray = start_ray,
+        .ray_count = ray_count,
+        .rect = {
+            .x = start_ray * ray_delta,
+            .y = height / 2.0f - sprite_height * (0.5 - OBJECT_OFFSET_FACTOR), // move sprites down a little
+            .w = ray_count * ray_delta,
+            .h = sprite_height,
+        },
+    };
+    return true;
+}
 
-    // sprite strips
-    start_ray -= 0.5f * sprite_width/ray_delta; // start from left
-    for (int i = start_ray; i < start_ray + ray_count; i++) {
-        float x = i * ray_delta;
-        if (x < 0 || x >= RESX) continue;
-        if (z_buffer[i] < depth) continue;
+void draw_column_layers(SDL_Renderer *renderer, int i, float ray_delta, float max_depth);
+
+void draw_sprite(SDL_Renderer *r, const ProjectedSprite *s, float ray_delta) {
+    const int mip = s->mip;
+    SDL_Texture *texture = s->texture->levels[mip];
+    float w = s->texture->mip_width[mip], h = s->texture->mip_height[mip];
+    set_texture_shade(texture, s->shade);
+
+    const int first = MAX(s->start_ray, 0);
+    const int end = MIN(s->start_ray + s->ray_count, g_render.ray_count);
+    if (e_state.software_render) {
+        // sprite strips
+        for (int i = first; i < end; i++) {
+            if (s->partly_hidden && g_z_buffer[i] < s->depth) continue;
+            float x = i * ray_delta;
+            int tex_x = w * (i - s->start_ray) / s->ray_count;
+            fb_draw_column(x, x + ray_delta, s->rect.y, s->rect.h, s->rect.y, s->rect.y + s->rect.h,
+                           s->texture, mip, tex_x, s->shade, true);
+            // walls in front that don't cover the column go back over it
+            draw_column_layers(r, i, ray_delta, s->depth);
+        }
+        return;
+    }
+
+    // one draw for each run of columns not behind a wall
+    for (int i = first; i < end;) {
+        if (s->partly_hidden && g_z_buffer[i] < s->depth) {
+            i++;
+            continue;
+        }
+        int run_end = i + 1;
+        while (run_end < end && !(s->partly_hidden && g_z_buffer[run_end] < s->depth)) run_end++;
 
         SDL_FRect src_rect = {
-            .x = w * (i - start_ray) / ray_count,
+            .x = w * (i - s->start_ray) / s->ray_count,
             .y = 0,
-            .w = ray_delta,
+            .w = w * (run_end - i) / s->ray_count,
             .h = h,
         };
         SDL_FRect dest_rect = {
-            .x = x, 
-            .y = RESY / 2.0f - sprite_height * (0.5 - OBJECT_OFFSET_FACTOR), // move sprites down a little
-            .w = ray_delta,
-            .h = sprite_height,
+            .x = i * ray_delta,
+            .y = s->rect.y,
+            .w = (run_end - i) * ray_delta,
+            .h = s->rect.h,
         };
-        SDL_RenderTexture(r, s.texture, &src_rect, &dest_rect);
+        SDL_RenderTexture(r, texture, &src_rect, &dest_rect);
+        for (int c = i; c < run_end; c++) draw_column_layers(r, c, ray_delta, s->depth);
+        i = run_end;
     }
-
 }
 
-#define WEAPON_WIDTH (RESX / 4.0f)
-void render_interface(SDL_Renderer *renderer) {
-    // Shotgun
-    SDL_Texture *weapon_texture = player.weapon.sprite.frames[player.weapon.sprite.current_frame];
-    float w, h;
-    SDL_GetTextureSize(weapon_texture, &w, &h);
+#define WEAPON_WIDTH (g_render.width / 4.0f)
+SDL_FRect weapon_rect(Texture *weapon_texture) {
+    float w = weapon_texture->width, h = weapon_texture->height;
     float weapon_height = h * (WEAPON_WIDTH / w);
-    SDL_FRect weapon_rect = {
-        .x = RESX / 2.0f - WEAPON_WIDTH / 2.0f,
-        .y = RESY - weapon_height,
+    return (SDL_FRect){
+        .x = g_render.width / 2.0f - WEAPON_WIDTH / 2.0f,
+        .y = g_render.height - weapon_height,
         .w = WEAPON_WIDTH,
         .h = weapon_height,
     };
-    SDL_RenderTexture(renderer, weapon_texture, NULL, &weapon_rect);
+}
 
+void render_interface(SDL_Renderer *renderer) {
+    // Shotgun
+    Texture *weapon_texture = player.weapon.sprite.frames[player.weapon.sprite.current_frame];
+    SDL_FRect rect = weapon_rect(weapon_texture);
+    SDL_RenderTexture(renderer, weapon_texture->levels[0], NULL, &rect);
+
+    draw_minimap(renderer);
 }
 
-// Render the game using raycasting
-void render_scene(SDL_Renderer *renderer) {
-    //---Environment---
+// Draw the visible part of one column's wall
+void draw_wall_slice(SDL_Renderer *renderer, const Column *column, int i, float ray_delta) {
+    const int height = g_render.height;
+    float rect_x = i * ray_delta;
+    float texture_u = column->texture_u;
+    Texture *texture = g_textures[column->wall_id];
+    bool alpha_test = g_wall_flags[column->wall_id] & WALL_TRANSPARENT;
+    // the open cell in front of the face
+    int light;
+    int cell_x = column->cell % g_map.width, cell_y = column->cell / g_map.width;
+    if (column->wall_orient == WALL_VERTICAL) {
+        light = light_at(cell_x + (g_camera.x < column->hit_x ? -1 : 1), cell_y) - WALL_CONTRAST;
+    } else {
+        light = light_at(cell_x, cell_y + (g_camera.y < column->hit_y ? -1 : 1));
+    }
+    Shade shade = get_shade(light, column->depth, (Color){255, 255, 255});
 
-    // Clear
-    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
-    SDL_RenderClear(renderer);
-    // Sky
-    const float sky_width = 1200;
-    float sky_fov = player.fov * 2.0f;
-    float sky_angle = -SDL_fmodf(player.angle, sky_fov);
-    float sky_offset = sky_angle < 0 ? sky_width : -sky_width; // sky2 offset 
-    float sky1_x = sky_angle * sky_width / sky_fov;
-    float sky2_x = sky_angle * sky_width / sky_fov + sky_offset;
-    SDL_RenderTexture(renderer, g_textures[TEXTURE_SKY], NULL, &(SDL_FRect){sky1_x, 0, sky_width, RESY/2.0f});
-    SDL_RenderTexture(renderer, g_textures[TEXTURE_SKY], NULL, &(SDL_FRect){sky2_x, 0, sky_width, RESY/2.0f});
+    // a full height wall, the texture covers heights 0 to 1 and repeats above that
+    float rect_height = height * (WALL_SCALE * player.radius / column->depth);
+    float rect_top = height / 2.0f - rect_height / 2.0f;
+    float y_top = rect_top + (1.0f - column->top) * rect_height;
+    float y_bottom = rect_top + (1.0f - column->bottom) * rect_height;
 
-    // Raycast Walls
-    const float ray_delta = (float)RESX / RAY_COUNT;
-    float angle_delta = player.fov / RAY_COUNT;
-    float angle = player.angle - player.fov / 2.0f;
-    float z_buffer[RAY_COUNT];
-
-    SDL_SetRenderDrawColor(renderer, 0, 0, 200, 255);
-    for (int i = 0; i < RAY_COUNT; i++) {
-        angle += angle_delta;
-        float rect_x = i * ray_delta;
-        RayData ray_data = cast_ray(player.x, player.y, angle);
-
-        float texture_u;
-        SDL_Texture *texture = g_textures[ray_data.wall_id];
-        if (ray_data.wall_orient == WALL_HORIZONTAL) {
-            texture_u = (ray_data.x - (int)ray_data.x);
-            SDL_SetTextureColorMod(texture, 255, 255, 255);
-        } else {
-            texture_u = (ray_data.y - (int)ray_data.y);
-            SDL_SetTextureColorMod(texture, 100, 100, 100);
-        }
-        texture_u = texture_u - (int)texture_u;
+    // far away walls sample a smaller mip
+    int mip = texture_mip_level(texture, rect_height);
+    float tex_width = texture->mip_width[mip], tex_height = texture->mip_height[mip];
 
-        // Take only direct component of a ray as the distance to wall
-        float distance = DISTANCE(player.x, player.y, ray_data.x, ray_data.y);
-        float depth = SDL_cos((player.angle - angle) * DEG2RAD) * distance;
-        z_buffer[i] = distance;
-        float rect_height = RESY * (WALL_SCALE * player.radius / depth);
-        float tex_height, tex_width;
-        SDL_GetTextureSize(texture, &tex_width, &tex_height);
+    if (e_state.software_render) {
+        fb_draw_column(rect_x, rect_x + ray_delta, rect_top, rect_height, y_top, y_bottom,
+                       texture, mip, texture_u * tex_width, shade, alpha_test);
+        return;
+    }
 
+    // a piece for each time the texture repeats
+    set_texture_shade(texture->levels[mip], shade);
+    for (float z = column->bottom; z < column->top;) {
+        float repeat = SDL_floorf(z);
+        float z_top = MIN(column->top, repeat + 1.0f);
         SDL_FRect dest_rect = {
             .x = rect_x, 
-            .y = RESY / 2.0f - rect_height / 2.0f,
+            .y = rect_top + (1.0f - z_top) * rect_height,
             .w = ray_delta,
-            .h = rect_height,
+            .h = (z_top - z) * rect_height,
         };
         SDL_FRect src_rect = {
             .x = texture_u * tex_width,
-            .y = 0,
+            .y = (repeat + 1.0f - z_top) * tex_height,
             .w = ray_delta,
-            .h = tex_height,
+            .h = (z_top - z) * tex_height,
         };
+        SDL_RenderTexture(renderer, texture->levels[mip], &src_rect, &dest_rect);
+        z = z_top;
+    }
+}
 
-        SDL_RenderTexture(renderer, texture, &src_rect, &dest_rect);
+// Draw the walls in front of a column's wall closer than max_depth, back to front
+void draw_column_layers(SDL_Renderer *renderer, int i, float ray_delta, float max_depth) {
+    for (int l = g_columns[i].layer_count - 1; l >= 0; l--) {
+        const Column *layer = &g_column_layers[i][l];
+        if (layer->depth < max_depth) draw_wall_slice(renderer, layer, i, ray_delta);
     }
+}
 
-    //---Sprites---
-    Sprite sprites[g_map.object_count*g_map.enemy_count];
+// Sky and walls, into the framebuffer or the current render target
+void draw_walls(SDL_Renderer *renderer) {
+    //---Environment---
+    const bool software = e_state.software_render;
+    const int width = g_render.width, height = g_render.height, ray_count = g_render.ray_count;
+    cast_columns(ray_count);
+
+    // Sky
+    const float sky_width = 1200 * g_render.scale;
+    float sky_fov = player.fov * 2.0f;
+    float sky_angle = -SDL_fmodf(player.angle, sky_fov);
+    float sky_offset = sky_angle < 0 ? sky_width : -sky_width; // sky2 offset 
+    float sky1_x = sky_angle * sky_width / sky_fov;
+    float sky2_x = sky_angle * sky_width / sky_fov + sky_offset;
+    if (software) {
+        fb_draw_background(sky1_x, sky_width);
+    } else {
+        // Clear
+        SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
+        SDL_RenderClear(renderer);
+        SDL_Texture *sky = g_textures[TEXTURE_SKY]->levels[0];
+        SDL_RenderTexture(renderer, sky, NULL, &(SDL_FRect){sky1_x, 0, sky_width, height/2.0f});
+        SDL_RenderTexture(renderer, sky, NULL, &(SDL_FRect){sky2_x, 0, sky_width, height/2.0f});
+    }
+
+    // Raycast Walls
+    const float ray_delta = (float)width / ray_count;
+
+    for (int i = 0; i < ray_count; i++) {
+        const Column *column = &g_columns[i];
+        g_z_buffer[i] = column->depth;
+        if (column->wall_id != 0) draw_wall_slice(renderer, column, i, ray_delta);
+        draw_column_layers(renderer, i, ray_delta, INFINITY);
+    }
+    build_z_pyramid(ray_count);
+}
+
+// Project a sprite into out[count] if any of it is in front of the walls, returns the new count
+int add_projected_sprite(ProjectedSprite *out, int count, Sprite sprite, float ray_delta) {
+    ProjectedSprite *p = &out[count];
+    if (!project_sprite(sprite, ray_delta, p)) return count;
+
+    // behind the walls of every column it covers
+    float z_min, z_max;
+    z_range(p->start_ray, p->start_ray + p->ray_count - 1, &z_min, &z_max);
+    if (z_max < p->depth) return count;
+    p->partly_hidden = z_min < p->depth;
+    return count + 1;
+}
+
+// Project every visible sprite, sorted back to front. out needs room for all objects and enemies.
+int collect_sprites(ProjectedSprite *out, float ray_delta) {
     int count = 0;
 
     // Objects
-    for (int i = 0; i < g_map.object_count; i++) {
-        Object obj = g_map.objects[i];
-        SDL_Texture *tex;
-        if (obj.sprite_type == OBJECT_STATIC)
-            tex = obj.sprite.static_frame;
+    const Objects *o = &g_map.objects;
+    for (int i = 0; i < o->count; i++) {
+        Texture *tex;
+        if (o->sprite_type[i] == OBJECT_STATIC)
+            tex = o->sprite[i].static_frame;
         else
-            tex = obj.sprite.animated.frames[obj.sprite.animated.current_frame];
-
-        sprites[count++] = (Sprite){obj.x, obj.y, tex, (Color){0xFF, 0xFF, 0xFF}};
+            tex = clip_frame(o->sprite[i].clip, o->phase[i]);
+        count = add_projected_sprite(out, count, (Sprite){o->x[i], o->y[i], tex, (Color){0xFF, 0xFF, 0xFF}}, ray_delta);
     }
     // Enemies
-    for (int i = 0; i < g_map.enemy_count; i++) {
-        Enemy e = g_map.enemies[i];
-        if (e.dead) continue;
-        SDL_Texture *tex = e.sprite.frames[e.sprite.current_frame];
-
+    const Enemies *e = &g_map.enemies;
+    for (int i = 0; i < e->count; i++) {
         Color tint = {0xFF, 0xFF, 0xFF};
-        if (e.state == ENEMY_HURT) tint = (Color){0xFA, 0x81, 0x81};
+        if (e->state[i] == ENEMY_HURT) tint = (Color){0xFA, 0x81, 0x81};
+        Sprite sprite = {e->x[i], e->y[i], clip_frame(e->clip[i], 0), tint};
+        count = add_projected_sprite(out, count, sprite, ray_delta);
+    }
+    qsort(out, count, sizeof(ProjectedSprite), sprite_compare);
+    return count;
+}
+
+bool same_projection(const ProjectedSprite *a, const ProjectedSprite *b) {
+    return a->texture == b->texture && a->mip == b->mip &&
+           a->tint.r == b->tint.r && a->tint.g == b->tint.g && a->tint.b == b->tint.b &&
+           a->start_ray == b->start_ray && a->ray_count == b->ray_count &&
+           a->rect.y == b->rect.y && a->rect.h == b->rect.h;
+}
 
-        sprites[count++] = (Sprite){e.x, e.y, tex, tint};
+// Grow rect to cover a float rect, clamped to the screen
+void dirty_rect_add(SDL_Rect *rect, SDL_FRect area) {
+    int x0 = MAX((int)SDL_floorf(area.x), 0), y0 = MAX((int)SDL_floorf(area.y), 0);
+    int x1 = MIN((int)SDL_ceilf(area.x + area.w), g_render.width);
+    int y1 = MIN((int)SDL_ceilf(area.y + area.h), g_render.height);
+    if (x0 >= x1 || y0 >= y1) return;
+    if (rect->w > 0) {
+        x0 = MIN(x0, rect->x);
+        y0 = MIN(y0, rect->y);
+        x1 = MAX(x1, rect->x + rect->w);
+        y1 = MAX(y1, rect->y + rect->h);
     }
-    qsort(sprites, count, sizeof(Sprite), sprite_compare);
-    for (int i = 0; i < count; i++) {
-        Sprite s = sprites[i];
-        SDL_SetTextureColorMod(s.texture, s.tint.r, s.tint.g, s.tint.b);
-        draw_sprite(renderer, sprites[i], z_buffer, ray_delta);
+    *rect = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+// Render the game using raycasting. If the view hasn't changed since the last frame the
+// wall pass is reused and only the area where sprites or the weapon changed is redrawn.
+// Returns false if nothing needed drawing.
+bool render_scene(SDL_Renderer *renderer, bool view_changed) {
+    const bool software = e_state.software_render;
+    const float ray_delta = (float)g_render.width / g_render.ray_count;
+    FrameCache *cache = &g_frame_cache;
+
+    // walls first, sprites are culled against them
+    if (view_changed) {
+        if (software) {
+            g_framebuffer.clip = (SDL_Rect){0, 0, g_render.width, g_render.height};
+            draw_walls(renderer);
+            int size = g_framebuffer.width * g_framebuffer.height;
+            if (e_state.indexed_color)
+                memcpy(g_framebuffer.indexed_walls, g_framebuffer.indexed, size);
+            else
+                memcpy(g_framebuffer.walls, g_framebuffer.pixels, size * sizeof(uint32_t));
+        } else {
+            SDL_Texture *target = SDL_GetRenderTarget(renderer);
+            SDL_SetRenderTarget(renderer, g_render.wall_layer);
+            draw_walls(renderer);
+            SDL_SetRenderTarget(renderer, target);
+            SDL_RenderTexture(renderer, g_render.wall_layer, NULL, NULL);
+        }
     }
 
+    // projected into the spare buffer, it becomes the cache at the end
+    int max_sprites = g_map.objects.count + g_map.enemies.count;
+    if (cache->sprite_capacity < max_sprites) {
+        cache->sprite_capacity = max_sprites;
+        cache->sprites = realloc(cache->sprites, max_sprites * sizeof(ProjectedSprite));
+        cache->next_sprites = realloc(cache->next_sprites, max_sprites * sizeof(ProjectedSprite));
+    }
+    ProjectedSprite *sprites = cache->next_sprites;
+    int sprite_count = collect_sprites(sprites, ray_delta);
+    Texture *weapon_texture = player.weapon.sprite.frames[player.weapon.sprite.current_frame];
+
+    // what changed since last frame
+    SDL_Rect dirty = {0};
+    if (view_changed) {
+        dirty = (SDL_Rect){0, 0, g_render.width, g_render.height};
+    } else {
+        for (int i = 0; i < MAX(sprite_count, cache->sprite_count); i++) {
+            bool in_old = i < cache->sprite_count, in_new = i < sprite_count;
+            if (in_old && in_new && same_projection(&cache->sprites[i], &sprites[i])) continue;
+            if (in_old) dirty_rect_add(&dirty, cache->sprites[i].rect);
+            if (in_new) dirty_rect_add(&dirty, sprites[i].rect);
+        }
+        if (cache->weapon_frame != player.weapon.sprite.current_frame) {
+            Texture *old_texture = player.weapon.sprite.frames[cache->weapon_frame];
+            dirty_rect_add(&dirty, weapon_rect(old_texture));
+            dirty_rect_add(&dirty, weapon_rect(weapon_texture));
+        }
+    }
+
+    // remember this frame
+    cache->next_sprites = cache->sprites;
+    cache->sprites = sprites;
+    cache->sprite_count = sprite_count;
+    cache->weapon_frame = player.weapon.sprite.current_frame;
+
+    if (dirty.w == 0) return false;
+
+    SDL_FRect dirty_f = {dirty.x, dirty.y, dirty.w, dirty.h};
+    if (!view_changed) {
+        // just the changed part
+        SDL_SetRenderClipRect(renderer, &dirty);
+        if (software) {
+            g_framebuffer.clip = dirty;
+            fb_restore_walls(dirty);
+        } else {
+            SDL_RenderTexture(renderer, g_render.wall_layer, &dirty_f, &dirty_f);
+        }
+    }
+
+    //---Sprites---
+    for (int i = 0; i < sprite_count; i++) {
+        if (sprites[i].rect.x >= dirty.x + dirty.w || sprites[i].rect.x + sprites[i].rect.w <= dirty.x ||
+            sprites[i].rect.y >= dirty.y + dirty.h || sprites[i].rect.y + sprites[i].rect.h <= dirty.y) continue;
+        draw_sprite(renderer, &sprites[i], ray_delta);
+    }
+
+    if (software) fb_present(renderer, dirty);
+    render_interface(renderer);
+
+    SDL_SetRenderClipRect(renderer, NULL);
+    g_framebuffer.clip = (SDL_Rect){0, 0, g_framebuffer.width, g_framebuffer.height};
+    return true;
+}
+
+// Render the frame into the fbo, returns false if it is the same as the last one
+bool render_frame(SDL_Renderer *renderer) {
+    FrameCache *cache = &g_frame_cache;
+    bool view_changed = !cache->valid || e_state.redraw ||
+        cache->x != player.x || cache->y != player.y || cache->angle != player.angle || cache->fov != player.fov ||
+        cache->map_revision != g_map.revision || cache->door_version != g_map.door_version ||
+        cache->lighting_version != g_map.lighting_version ||
+        cache->width != g_render.width || cache->height != g_render.height ||
+        cache->map_mode != e_state.map_mode || cache->software_render != e_state.software_render ||
+        cache->wall_spans != e_state.wall_spans || cache->interlaced != e_state.interlaced ||
+        cache->reveal_map != e_state.reveal_map || cache->indexed_color != e_state.indexed_color;
+
+    cache->valid = true;
+    cache->x = player.x;
+    cache->y = player.y;
+    cache->angle = player.angle;
+    cache->fov = player.fov;
+    cache->map_revision = g_map.revision;
+    cache->door_version = g_map.door_version;
+    cache->lighting_version = g_map.lighting_version;
+    cache->width = g_render.width;
+    cache->height = g_render.height;
+    cache->map_mode = e_state.map_mode;
+    cache->software_render = e_state.software_render;
+    cache->wall_spans = e_state.wall_spans;
+    cache->interlaced = e_state.interlaced;
+    cache->reveal_map = e_state.reveal_map;
+    cache->indexed_color = e_state.indexed_color;
+    e_state.redraw = false;
+    cache->full_redraw = view_changed;
+
+    if (e_state.map_mode) {
+        if (!view_changed) return false;
+        cast_columns(g_render.ray_count);
+        draw_level_map(renderer);
+        return true;
+    }
+    return render_scene(renderer, view_changed);
+}
+
+//---Dynamic Resolution---
+
+// Resize everything that depends on the internal resolution. The fbo and the streaming
+// texture are recreated at the new size, the cpu framebuffer is allocated at full size once.
+void set_render_scale(SDL_Renderer *renderer, float scale) {
+    g_render.scale = scale;
+    g_render.width = MAX((int)(RESX * scale), 1);
+    g_render.height = MAX((int)(RESY * scale), 1);
+    g_render.ray_count = g_render.width;
+
+    if (g_render.fbo) SDL_DestroyTexture(g_render.fbo);
+    g_render.fbo = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                     SDL_TEXTUREACCESS_TARGET, g_render.width, g_render.height);
+    if (g_render.wall_layer) SDL_DestroyTexture(g_render.wall_layer);
+    g_render.wall_layer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                            SDL_TEXTUREACCESS_TARGET, g_render.width, g_render.height);
+
+    if (!g_framebuffer.pixels) {
+        g_framebuffer.pixels = malloc(RESX * RESY * sizeof(uint32_t));
+        g_framebuffer.walls = malloc(RESX * RESY * sizeof(uint32_t));
+        g_framebuffer.indexed = malloc(RESX * RESY);
+        g_framebuffer.indexed_walls = malloc(RESX * RESY);
+    }
+    if (g_framebuffer.texture) SDL_DestroyTexture(g_framebuffer.texture);
+    g_framebuffer.width = g_render.width;
+    g_framebuffer.height = g_render.height;
+    g_framebuffer.clip = (SDL_Rect){0, 0, g_render.width, g_render.height};
+    g_framebuffer.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888,
+                                              SDL_TEXTUREACCESS_STREAMING, g_render.width, g_render.height);
+
+    if (g_map.width > 0) {
+        g_map.x_scale = (float)g_render.width / g_map.width;
+        g_map.y_scale = (float)g_render.height / g_map.height;
+        if (g_map.grid) SDL_DestroyTexture(g_map.grid);
+        g_map.grid = NULL;
+    }
+}
+
+// Called once a frame with how long the frame took (without the frame limiter). Drops the
+// resolution a step after GOVERNOR_DOWN_FRAMES slow frames in a row and only raises it after
+// GOVERNOR_UP_FRAMES frames that would still be in budget at the higher resolution, so it
+// settles instead of bouncing between two scales.
+void update_resolution_governor(SDL_Renderer *renderer, double frame_time) {
+    if (!g_render.dynamic) {
+        // back to full resolution when turned off
+        if (g_render.scale != 1.0f) set_render_scale(renderer, 1.0f);
+        return;
+    }
+
+    g_render.frame_time = 0.9 * g_render.frame_time + 0.1 * frame_time;
+    float up_scale = MIN(g_render.scale + RENDER_SCALE_STEP, 1.0f);
+    // cost grows with the number of pixels
+    double up_ratio = (up_scale * up_scale) / (g_render.scale * g_render.scale);
+
+    if (g_render.frame_time > TARGET_FRAME_TIME) g_render.slow_frames++;
+    else g_render.slow_frames = 0;
+    if (g_render.frame_time * up_ratio < 0.8 * TARGET_FRAME_TIME) g_render.fast_frames++;
+    else g_render.fast_frames = 0;
+
+    float scale = g_render.scale;
+    if (g_render.slow_frames >= GOVERNOR_DOWN_FRAMES && scale > MIN_RENDER_SCALE)
+        scale = MAX(scale - RENDER_SCALE_STEP, MIN_RENDER_SCALE);
+    else if (g_render.fast_frames >= GOVERNOR_UP_FRAMES && scale < 1.0f)
+        scale = up_scale;
+    else
+        return;
+
+    // assume the new resolution costs what the pixel count predicts until it is measured
+    g_render.frame_time *= (scale * scale) / (g_render.scale * g_render.scale);
+    g_render.slow_frames = 0;
+    g_render.fast_frames = 0;
+    set_render_scale(renderer, scale);
 }
 
-int main() {
+//---Benchmarks---
+
+#define BENCH_TEXTURE_SIZE 1024
+#define BENCH_FRAMES 200
+
+// The texture mapping inner loop the software renderer used before textures were
+// stored column-major, kept to compare against.
+void bench_column_row_major(int x, float top, float height, const uint32_t *texels, int tex_w, int tex_h, int tex_x, Shade shade) {
+    int y0 = MAX((int)SDL_ceilf(top), 0);
+    int y1 = MIN((int)SDL_ceilf(top + height), g_framebuffer.height);
+    uint32_t v_step = (uint32_t)(tex_h * 65536.0f / height);
+    uint32_t v = (uint32_t)((y0 + 0.5f - top) * v_step);
+    const uint32_t *column = texels + tex_x;
+    uint32_t *dst = g_framebuffer.pixels + y0*g_framebuffer.width + x;
+    for (int y = y0; y < y1; y++, dst += g_framebuffer.width, v += v_step) {
+        uint32_t c = column[MIN((int)(v >> 16), tex_h - 1) * tex_w];
+        *dst = PACK_COLOR(shade.r[COLOR_R(c)], shade.g[COLOR_G(c)], shade.b[COLOR_B(c)], 0xFF);
+    }
+}
+
+// Times drawing a full screen of wall columns from a full size texture (the case mips
+// don't help with: walls close to the camera) with both texel layouts.
+void run_texture_benchmark() {
+    g_framebuffer.width = RESX;
+    g_framebuffer.height = RESY;
+    g_framebuffer.clip = (SDL_Rect){0, 0, RESX, RESY};
+    g_framebuffer.pixels = malloc(RESX * RESY * sizeof(uint32_t));
+
+    const int size = BENCH_TEXTURE_SIZE;
+    uint32_t *row_major = malloc(size * size * sizeof(uint32_t));
+    for (int i = 0; i < size * size; i++) row_major[i] = PACK_COLOR(i, i >> 8, i >> 16, 0xFF);
+
+    Texture texture = {
+        .width = size,
+        .height = size,
+        .mip_count = 1,
+        .mip_width = {size},
+        .mip_height = {size},
+        .mip_shift = {pow2_shift(size)},
+    };
+    texture.pixels[0] = transpose_image(row_major, size, size, texture.mip_shift[0]);
+
+    // wall heights from a quarter of the screen up to 4x the screen (mostly clipped)
+    const float heights[] = {RESY * 0.25f, RESY * 1.0f, RESY * 4.0f};
+    for (int h = 0; h < 3; h++) {
+        float height = heights[h];
+        float top = RESY / 2.0f - height / 2.0f;
+        double times[2];
+        uint32_t checksums[2];
+        Shade shade = get_shade(LIGHT_LEVELS / 2, 0, (Color){255, 255, 255});
+        for (int layout = 0; layout < 2; layout++) {
+            // cleared so a layout that draws nothing can't match the other's image
+            memset(g_framebuffer.pixels, 0, RESX * RESY * sizeof(uint32_t));
+            uint64_t start = SDL_GetPerformanceCounter();
+            for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+                for (int x = 0; x < RESX; x++) {
+                    // walls seen at an angle step through the texture a few texels per column
+                    int tex_x = (x * 3 + frame) % size;
+                    if (layout == 0)
+                        bench_column_row_major(x, top, height, row_major, size, size, tex_x, shade);
+                    else
+                        fb_draw_column(x, x + 1, top, height, top, top + height, &texture, 0, tex_x, shade, false);
+                }
+            }
+            uint64_t end = SDL_GetPerformanceCounter();
+            times[layout] = (double)(end - start) / SDL_GetPerformanceFrequency() * 1000.0 / BENCH_FRAMES;
+
+            // both layouts have to produce the same image
+            checksums[layout] = 0;
+            for (int i = 0; i < RESX * RESY; i++) checksums[layout] = checksums[layout] * 31 + g_framebuffer.pixels[i];
+        }
+        printf("wall height %4.0fpx: row-major %.3f ms/frame, column-major %.3f ms/frame (%.2fx)%s\n",
+               height, times[0], times[1], times[0] / times[1],
+               checksums[0] == checksums[1] ? "" : " OUTPUT MISMATCH");
+    }
+
+    free(row_major);
+    free(texture.pixels[0]);
+    free(g_framebuffer.pixels);
+}
+
+// Times the sky and floor pass at 1080p with one thread and with the worker pool
+void run_floor_benchmark() {
+    const int width = 1920, height = 1080;
+    g_framebuffer.width = width;
+    g_framebuffer.height = height;
+    g_framebuffer.clip = (SDL_Rect){0, 0, width, height};
+    g_framebuffer.pixels = malloc(width * height * sizeof(uint32_t));
+
+    const int size = BENCH_TEXTURE_SIZE;
+    Texture texture = {.width = size, .height = size};
+    uint32_t *levels[MAX_MIP_LEVELS];
+    levels[0] = malloc(size * size * sizeof(uint32_t));
+    for (int i = 0; i < size * size; i++) levels[0][i] = PACK_COLOR(i, i >> 8, i >> 16, 0xFF);
+    for (int mip_size = size, level = 0; mip_size >= 1 && level < MAX_MIP_LEVELS; mip_size /= 2, level++) {
+        if (level > 0) {
+            levels[level] = malloc(mip_size * mip_size * sizeof(uint32_t));
+            downsample_image(levels[level - 1], mip_size * 2, mip_size * 2, levels[level], mip_size, mip_size);
+        }
+        texture.mip_width[level] = texture.mip_height[level] = mip_size;
+        texture.mip_shift[level] = pow2_shift(mip_size);
+        texture.pixels[level] = transpose_image(levels[level], mip_size, mip_size, texture.mip_shift[level]);
+        texture.mip_count = level + 1;
+    }
+    g_textures[TEXTURE_SKY] = &texture;
+    g_textures[TEXTURE_FLOOR] = &texture;
+
+    // a lit room for the floor to sample
+    g_map.width = g_map.height = 16;
+    g_map.light_grid = malloc(16 * 16);
+    for (int i = 0; i < 16 * 16; i++) g_map.light_grid[i] = i % LIGHT_LEVELS;
+
+    int thread_counts[2] = {0, SDL_GetNumLogicalCPUCores() - 1};
+    for (int t = 0; t < 2; t++) {
+        init_workers(thread_counts[t]);
+        uint64_t start = SDL_GetPerformanceCounter();
+        for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+            player.angle = frame * 360.0f / BENCH_FRAMES;
+            update_camera();
+            fb_draw_background(0, width);
+        }
+        uint64_t end = SDL_GetPerformanceCounter();
+        double time = (double)(end - start) / SDL_GetPerformanceFrequency() * 1000.0 / BENCH_FRAMES;
+        printf("sky and floor at %dx%d, %d worker threads: %.3f ms/frame (%.0f%% of the frame budget)\n",
+               width, height, g_workers.count, time, time / (TARGET_FRAME_TIME * 1000.0) * 100.0);
+        destroy_workers();
+    }
+
+    g_textures[TEXTURE_SKY] = NULL;
+    g_textures[TEXTURE_FLOOR] = NULL;
+    free(g_map.light_grid);
+    g_map = (Map){0};
+    for (int i = 0; i < texture.mip_count; i++) {
+        free(levels[i]);
+        free(texture.pixels[i]);
+    }
+    free(g_framebuffer.pixels);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        init_shade_tables();
+        run_texture_benchmark();
+        run_floor_benchmark();
+        return 0;
+    }
+
     SDL_Window *window;
     SDL_Renderer *renderer;
     init_sdl(&renderer, &window, SCREEN_WIDTH, SCREEN_HEIGHT);
-    SDL_Texture *fbo = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
-                                         SDL_TEXTUREACCESS_TARGET, RESX, RESY);
+    init_workers(SDL_GetNumLogicalCPUCores() - 1);
+    init_shade_tables();
+    set_render_scale(renderer, 1.0f);
 
     create_map(renderer);
+    build_palette();
 
     while(!e_state.quit) {
         // update time
         double time = SDL_GetTicksNS() * 1e-9;
-        if (time - e_state.last_frame < DESIRED_FRAME_TIME) {
+        if (!e_state.frame_changed) {
+            // nothing moved last frame, sleep until there is input
+            SDL_WaitEventTimeout(NULL, IDLE_WAIT_MS);
+            time = SDL_GetTicksNS() * 1e-9;
+        } else if (time - e_state.last_frame < DESIRED_FRAME_TIME) {
             double delay = 1000 * (DESIRED_FRAME_TIME - (time - e_state.last_frame));
             SDL_Delay(delay);
         }
         time = SDL_GetTicksNS() * 1e-9;
         e_state.delta_time = time - e_state.last_frame;
         e_state.last_frame = time;
+        e_state.time += e_state.delta_time;
 
         // inputs and player update
         handle_events();
         handle_player_input();
 
         // game updates
-        update_animations();
+        update_timers();
         update_enemies();
+        update_doors();
+        update_lighting();
 
         // render
-        SDL_SetRenderTarget(renderer, fbo);
-        if (!e_state.map_mode) {
-            render_scene(renderer);
-            render_interface(renderer);
-        } else {
-            draw_level_map(renderer);
-        }
-
+        SDL_SetRenderTarget(renderer, g_render.fbo);
+        e_state.frame_changed = render_frame(renderer);
         SDL_SetRenderTarget(renderer, NULL);
+        if (!e_state.frame_changed) continue;
+
+        // upscale to the window
         SDL_RenderClear(renderer);
-        SDL_RenderTexture(renderer, fbo, NULL, NULL);
+        SDL_RenderTexture(renderer, g_render.fbo, NULL, NULL);
 
+        // partial frames say nothing about how long a full one takes
+        if (g_frame_cache.full_redraw)
+            update_resolution_governor(renderer, SDL_GetTicksNS() * 1e-9 - time);
         SDL_RenderPresent(renderer);
     }
 
     // Cleanup
+    destroy_workers();
     destroy_map();
+    free_timers();
+    free_line_of_sight();
 
     SDL_DestroyWindow(window);
-    SDL_DestroyTexture(fbo);
+    SDL_DestroyTexture(g_render.fbo);
+    SDL_DestroyTexture(g_render.wall_layer);
+    SDL_DestroyTexture(g_framebuffer.texture);
+    free(g_framebuffer.pixels);
+    free(g_framebuffer.walls);
+    free(g_framebuffer.indexed);
+    free(g_framebuffer.indexed_walls);
+    destroy_palette();
+    free(g_frame_cache.sprites);
+    free(g_frame_cache.next_sprites);
+    free(g_discs.vertices);
+    free(g_discs.indices);
     SDL_DestroyRenderer(renderer);
     return 0;
 }